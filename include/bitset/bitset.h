@@ -87,12 +87,17 @@ typedef uint64_t bitset_offset;
 #endif
 
 /**
- * Bitset types.
+ * Bitset types. The size is the capacity of the buffer in words. A size of 0
+ * with a buffer means the words are borrowed, e.g. from a vector, and aren't
+ * owned by the bitset. Resizing a borrowed bitset copies its words into a
+ * buffer of its own, which the caller then frees.
  */
 
 typedef struct bitset_s {
     bitset_word *buffer;
     size_t length;
+    size_t size;
+    uint64_t version;
 } bitset_t;
 
 typedef struct bitset_iterator_s {
@@ -107,7 +112,7 @@ typedef struct bitset_iterator_s {
 bitset_t *bitset_new(void);
 
 /**
- * Clear the specified bitset.
+ * Clear the specified bitset. The buffer is kept for reuse.
  */
 
 void bitset_clear(bitset_t *);
@@ -119,11 +124,17 @@ void bitset_clear(bitset_t *);
 void bitset_free(bitset_t *);
 
 /**
- * Resize the bitset buffer.
+ * Resize the bitset buffer. A borrowed buffer is copied rather than resized.
  */
 
 void bitset_resize(bitset_t *, size_t);
 
+/**
+ * Release any buffer capacity that isn't required by the bitset.
+ */
+
+void bitset_shrink(bitset_t *);
+
 /**
  * Get the byte length of the bitset buffer.
  */
@@ -199,6 +210,25 @@ bitset_offset bitset_min(const bitset_t *);
 
 bitset_offset bitset_max(const bitset_t *);
 
+/**
+ * Check whether two bitsets have at least one set bit in common.
+ */
+
+bool bitset_intersects(const bitset_t *, const bitset_t *);
+
+/**
+ * Check whether every bit set in the first bitset is also set in the second.
+ */
+
+bool bitset_is_subset(const bitset_t *, const bitset_t *);
+
+/**
+ * Check whether two bitsets contain the same bits, regardless of how they
+ * are encoded.
+ */
+
+bool bitset_equals(const bitset_t *, const bitset_t *);
+
 /**
  * Create a new bitset iterator.
  */
@@ -27,6 +27,16 @@ typedef struct bitset_countn_s {
     size_t size;
 } bitset_countn_t;
 
+/**
+ * Bitset HyperLogLog type.
+ */
+
+typedef struct bitset_hll_s {
+    unsigned char *registers;
+    unsigned precision;
+    size_t size;
+} bitset_hll_t;
+
 /**
  * Estimate unique bits using an uncompressed bitset of the specified size
  * (bloom filter where n=1).
@@ -94,6 +104,33 @@ void bitset_countn_count_free(unsigned *);
 
 void bitset_countn_free(bitset_countn_t *);
 
+/**
+ * Estimate unique bits using a HyperLogLog sketch. The sketch uses a fixed
+ * amount of memory chosen so that the standard error of the estimate is
+ * around the specified ratio, e.g. 0.01 uses 16KB. An error of zero or less
+ * gives the most precise sketch, which uses 256KB.
+ */
+
+bitset_hll_t *bitset_hll_new(double error);
+
+/**
+ * Add the bits in the bitset to the sketch.
+ */
+
+void bitset_hll_add(bitset_hll_t *, const bitset_t *);
+
+/**
+ * Get the estimated unique bit count.
+ */
+
+unsigned bitset_hll_count(const bitset_hll_t *);
+
+/**
+ * Free the sketch.
+ */
+
+void bitset_hll_free(bitset_hll_t *);
+
 #ifdef __cplusplus
 } //extern "C"
 #endif
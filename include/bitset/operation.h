@@ -36,12 +36,14 @@ enum bitset_operation_type {
 };
 
 typedef struct bitset_operation_s bitset_operation_t;
+typedef struct bitset_operation_cache_s bitset_operation_cache_t;
 
 typedef struct bitset_operation_step_s {
     union {
         bitset_t bitset;
         bitset_operation_t *nested;
     } data;
+    bitset_t *source;
     bool is_nested;
     bool is_operation;
     enum bitset_operation_type type;
@@ -50,6 +52,35 @@ typedef struct bitset_operation_step_s {
 struct bitset_operation_s {
     bitset_operation_step_t **steps;
     size_t length;
+    bitset_operation_cache_t *cache;
+    uint64_t *fingerprint;
+    size_t fingerprint_length;
+};
+
+/**
+ * Nested operation result cache types.
+ */
+
+typedef struct bitset_operation_cache_entry_s {
+    uint64_t key;
+    uint64_t *fingerprint;
+    size_t fingerprint_length;
+    bitset_t bitset;
+    struct bitset_operation_cache_entry_s *next;
+    struct bitset_operation_cache_entry_s *newer;
+    struct bitset_operation_cache_entry_s *older;
+} bitset_operation_cache_entry_t;
+
+struct bitset_operation_cache_s {
+    bitset_operation_cache_entry_t **buckets;
+    bitset_operation_cache_entry_t *newest;
+    bitset_operation_cache_entry_t *oldest;
+    size_t size;
+    size_t count;
+    size_t bytes;
+    size_t max_bytes;
+    unsigned hits;
+    unsigned misses;
 };
 
 /**
@@ -88,6 +119,14 @@ void bitset_operation_add_nested(bitset_operation_t *, bitset_operation_t *, enu
 
 bitset_t *bitset_operation_exec(bitset_operation_t *);
 
+/**
+ * Execute the operation and store the result in an existing bitset. The
+ * bitset's buffer is reused and only grows when the result doesn't fit;
+ * use bitset_shrink() to release unused capacity.
+ */
+
+void bitset_operation_exec_into(bitset_operation_t *, bitset_t *);
+
 /**
  * Get the population count of the operation result without using
  * a temporary bitset.
@@ -95,6 +134,70 @@ bitset_t *bitset_operation_exec(bitset_operation_t *);
 
 bitset_offset bitset_operation_count(bitset_operation_t *);
 
+/**
+ * Check whether the operation result has at least the specified number of
+ * set bits. Evaluation stops as soon as the answer is known.
+ */
+
+bool bitset_operation_count_at_least(bitset_operation_t *, bitset_offset);
+
+/**
+ * Get up to the specified number of bits from the operation result, starting
+ * at the specified offset and working up. Evaluation stops once enough bits
+ * have been found.
+ */
+
+bitset_iterator_t *bitset_operation_exec_range(bitset_operation_t *, bitset_offset start, size_t limit);
+
+/**
+ * Get up to the specified number of bits from the operation result, starting
+ * at the specified offset and working down.
+ */
+
+bitset_iterator_t *bitset_operation_exec_range_desc(bitset_operation_t *, bitset_offset start, size_t limit);
+
+/**
+ * Create a cache for the results of nested operations. Results are keyed by
+ * the nested operation's structure and the identity and version of its
+ * operands, and the least recently used results are evicted once the cache
+ * holds more than the specified number of bytes. Caches aren't thread-safe.
+ *
+ * A bitset is given a version the first time an operation that uses it is
+ * looked up in a cache, and the version is reset by the functions that modify
+ * it; bitsets whose buffer is modified
+ * directly must have their version reset to zero. Operations that use
+ * bitset_operation_add_buffer() aren't cached since their operands have no
+ * version.
+ */
+
+bitset_operation_cache_t *bitset_operation_cache_new(size_t);
+
+/**
+ * Free the cache.
+ */
+
+void bitset_operation_cache_free(bitset_operation_cache_t *);
+
+/**
+ * Consult the cache when flattening nested operations. The cache is inherited
+ * by nested operations that don't have their own cache.
+ */
+
+void bitset_operation_set_cache(bitset_operation_t *, bitset_operation_cache_t *);
+
+/**
+ * Execute a batch of operations and store each result in the specified array.
+ * Operands that are shared between operations are only decoded once.
+ */
+
+void bitset_operation_exec_batch(bitset_operation_t **, size_t, bitset_t **);
+
+/**
+ * Get the population count of each operation in a batch.
+ */
+
+void bitset_operation_count_batch(bitset_operation_t **, size_t, bitset_offset *);
+
 #ifdef __cplusplus
 } //extern "C"
 #endif
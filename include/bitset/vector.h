@@ -30,13 +30,59 @@ extern "C" {
  * Bitset vector types.
  */
 
+typedef struct bitset_vector_directory_s {
+    unsigned *offsets;
+    size_t *positions;
+    size_t length;
+    size_t size;
+    unsigned interval;
+} bitset_vector_directory_t;
+
 typedef struct bitset_vector_s {
     char *buffer;
     size_t length;
     size_t size;
     unsigned tail_offset;
+    unsigned base_offset;
+    unsigned count;
+    bitset_vector_directory_t *directory;
+    bitset_offset *popcounts;
+    size_t popcounts_size;
 } bitset_vector_t;
 
+typedef struct bitset_vector_segmented_s {
+    bitset_vector_t **segments;
+    size_t length;
+    size_t size;
+    size_t segment_size;
+    unsigned count;
+} bitset_vector_segmented_t;
+
+typedef struct bitset_vector_buffer_s {
+    bitset_vector_t *vector;
+    unsigned *offsets;
+    bitset_t **bitsets;
+    bitset_t *scratch;
+    size_t length;
+    size_t size;
+    size_t limit;
+} bitset_vector_buffer_t;
+
+typedef struct bitset_vector_trailer_s {
+    size_t length;
+    uint64_t raw;
+    unsigned tail_offset;
+    unsigned count;
+    unsigned version;
+    unsigned flags;
+} bitset_vector_trailer_t;
+
+enum bitset_vector_cardinality_strategy {
+    BITSET_CARDINALITY_LINEAR,
+    BITSET_CARDINALITY_EXACT,
+    BITSET_CARDINALITY_HLL
+};
+
 typedef struct bitset_vector_operation_s bitset_vector_operation_t;
 
 typedef struct bitset_vector_operation_step_s {
@@ -45,6 +91,7 @@ typedef struct bitset_vector_operation_step_s {
         bitset_vector_operation_t *operation;
     } data;
     void *userdata;
+    int shift;
     bool is_nested;
     bool is_operation;
     enum bitset_operation_type type;
@@ -52,14 +99,41 @@ typedef struct bitset_vector_operation_step_s {
 
 struct bitset_vector_operation_s {
     bitset_vector_operation_step_t **steps;
-    unsigned min;
-    unsigned max;
+    unsigned start;
+    unsigned end;
     size_t length;
 };
 
 #define BITSET_VECTOR_START 0
 #define BITSET_VECTOR_END 0
 
+/**
+ * An exported vector can be followed by a trailer which lets the vector be
+ * imported without scanning its bitsets. The trailer ends with 44 bytes
+ *
+ *    <length:8><raw:8><last:8><tail_offset:4><count:4><version:2><flags:2><checksum:4><magic:4>
+ *
+ * which are preceded by 8 bytes per bitset when counts are stored, so the
+ * whole trailer is 44 + 8 * count bytes. The last field is the position of
+ * the last bitset in the buffer, and the checksum covers the 44 bytes along
+ * with the first and last offset deltas. Trailers with a newer version are
+ * ignored.
+ *
+ * NOTE: the checksum only catches a damaged trailer or one that belongs to
+ * another buffer. It doesn't cover the bitsets or the stored counts.
+ */
+
+#define BITSET_VECTOR_TRAILER_LENGTH 44
+#define BITSET_VECTOR_TRAILER_MAGIC 0x42535654
+#define BITSET_VECTOR_TRAILER_VERSION 1
+
+/**
+ * When the counts flag is set, the population count of each bitset is stored
+ * as an 8 byte integer between the vector buffer and the trailer.
+ */
+
+#define BITSET_VECTOR_TRAILER_COUNTS 1
+
 /**
  * Create a new bitset vector.
  */
@@ -67,7 +141,13 @@ struct bitset_vector_operation_s {
 bitset_vector_t *bitset_vector_new(void);
 
 /**
- * Create a new bitset vector based on an existing buffer.
+ * Create a new bitset vector based on an existing buffer. When the buffer ends
+ * with a trailer, the tail offset and count are read from it rather than by
+ * scanning the buffer.
+ *
+ * NOTE: import doesn't validate the payload. Bitsets are used as they are,
+ * stored counts are trusted, and a corrupt or truncated buffer can lead to
+ * reads past its end later on. Only import buffers from a trusted source.
  */
 
 bitset_vector_t *bitset_vector_import(const char *, size_t);
@@ -85,29 +165,91 @@ void bitset_vector_free(bitset_vector_t *);
 bitset_vector_t *bitset_vector_copy(const bitset_vector_t *);
 
 /**
- * Get the vector buffer.
+ * Give a view, or any vector whose offsets follow a base offset, a buffer of
+ * its own with offsets starting from zero so that it can be exported. The
+ * vector is no longer a view afterwards.
+ */
+
+void bitset_vector_rebase(bitset_vector_t *);
+
+/**
+ * Get the vector buffer. Views must be rebased before they're exported.
  */
 
 char *bitset_vector_export(const bitset_vector_t *);
 
 /**
- * Get the byte length of the vector buffer.
+ * Get the byte length of the exported vector buffer.
  */
 
 size_t bitset_vector_length(const bitset_vector_t *);
 
+/**
+ * Get the byte length of the vector trailer, including stored counts.
+ */
+
+size_t bitset_vector_trailer_length(const bitset_vector_t *);
+
+/**
+ * Write a trailer for the vector buffer to the specified location, which must
+ * have room for bitset_vector_trailer_length() bytes. The trailer should be
+ * written directly after the buffer returned by bitset_vector_export().
+ */
+
+void bitset_vector_export_trailer(const bitset_vector_t *, char *trailer);
+
+/**
+ * Read the trailer at the end of the buffer. Returns false when the buffer
+ * doesn't end with a valid trailer.
+ */
+
+bool bitset_vector_read_trailer(const char *, size_t, bitset_vector_trailer_t *);
+
 /**
  * Get the number of bitsets in the vector.
  */
 
 unsigned bitset_vector_bitsets(const bitset_vector_t *);
 
+/**
+ * Build a directory of every Nth bitset in the vector so that bitsets can be
+ * found by offset without walking the whole vector. The directory is kept up
+ * to date as bitsets are added.
+ */
+
+void bitset_vector_build_directory(bitset_vector_t *, unsigned interval);
+
+/**
+ * Store the population count of each bitset with the vector, so that raw and
+ * per-offset counts are read without decoding bitsets. Stored counts are kept
+ * current as the vector is modified, carried over to the results of vector
+ * operations and copies, and exported with the trailer.
+ */
+
+void bitset_vector_store_counts(bitset_vector_t *);
+
+/**
+ * Find the bitset at the specified offset. The bitset references the vector
+ * buffer and shouldn't be modified or freed.
+ */
+
+bool bitset_vector_get(const bitset_vector_t *, unsigned offset, bitset_t *);
+
 /**
  * Push a bitset on to the end of the vector.
  */
 
 void bitset_vector_push(bitset_vector_t *, const bitset_t *, unsigned);
 
+/**
+ * Set or unset a bit in the bitset at the specified offset, adding or removing
+ * the bitset as needed. The entry is edited in place and only the bytes that
+ * follow it are moved. Returns the previous value of the bit.
+ */
+
+bool bitset_vector_set(bitset_vector_t *, unsigned offset, bitset_offset);
+bool bitset_vector_unset(bitset_vector_t *, unsigned offset, bitset_offset);
+
 /**
  * Resize the vector buffer.
  */
@@ -121,7 +263,7 @@ void bitset_vector_resize(bitset_vector_t *, size_t);
 #define BITSET_VECTOR_FOREACH(vector, bitset, offset) \
     bitset_t BITSET_TMPVAR(tmp, __LINE__); \
     bitset = &BITSET_TMPVAR(tmp, __LINE__); \
-    offset = 0; \
+    offset = (vector)->base_offset; \
     char *BITSET_TMPVAR(buffer, __LINE__) = vector->buffer; \
     while (BITSET_TMPVAR(buffer, __LINE__) < (vector->buffer + vector->length) \
         ? (BITSET_TMPVAR(buffer, __LINE__) = bitset_vector_advance(BITSET_TMPVAR(buffer, __LINE__), \
@@ -138,18 +280,181 @@ char *bitset_vector_advance(char *buffer, bitset_t *, unsigned *);
 void bitset_vector_concat(bitset_vector_t *, const bitset_vector_t *, unsigned offset,
     unsigned start, unsigned end);
 
+/**
+ * Create a read-only view of the bitsets in the vector between start and end.
+ * The view references the vector buffer rather than copying it, so it must be
+ * freed before the vector is modified or freed. Views can be used anywhere a
+ * vector is read; copy the view to get a vector that can be modified.
+ */
+
+bitset_vector_t *bitset_vector_view(const bitset_vector_t *, unsigned start, unsigned end);
+
 /**
  * Get a raw and unique count for set items in the vector.
  */
 
 void bitset_vector_cardinality(const bitset_vector_t *, unsigned *, unsigned *);
 
+/**
+ * Get a raw and unique count using the specified strategy for unique counts.
+ * LINEAR uses a linear counter sized from the raw count, EXACT streams a
+ * union of the vector's bitsets in memory proportional to the number of
+ * bitsets, and HLL uses a fixed-size sketch with the specified standard error.
+ */
+
+void bitset_vector_cardinality_with(const bitset_vector_t *, unsigned *, unsigned *,
+    enum bitset_vector_cardinality_strategy, double error);
+
+/**
+ * Get the offset and population count of each bitset between start and end in
+ * a single pass, optionally counting only the bits that are also in a mask.
+ * The arrays must have room for bitset_vector_bitsets() items. Returns the
+ * number of items written.
+ */
+
+size_t bitset_vector_counts(const bitset_vector_t *, unsigned start, unsigned end,
+    const bitset_t *mask, unsigned *offsets, bitset_offset *counts);
+
+/**
+ * Intersect each bitset with a mask and get the population count of each
+ * result. The mask is decoded once and searched from each bitset's words, so
+ * sparse bitsets skip over the parts of the mask they don't touch.
+ */
+
+size_t bitset_vector_mask_count(const bitset_vector_t *, const bitset_t *mask,
+    unsigned *offsets, bitset_offset *counts);
+
+/**
+ * Build a retention matrix. For the bitset at each offset d, count the bits
+ * that are also in the bitset at offset d + k for each lag k from 0 to
+ * max_lag, so column 0 holds the size of each cohort. The matrix has a row
+ * for each bitset in the vector and max_lag + 1 columns, and must have room
+ * for bitset_vector_bitsets() * (max_lag + 1) items. Rows are split into a
+ * contiguous range for each of up to the specified number of threads, and
+ * each thread keeps at most max_lag + 1 decoded bitsets at a time.
+ */
+
+void bitset_vector_retention(const bitset_vector_t *, unsigned max_lag,
+    bitset_offset *matrix, unsigned threads);
+
 /**
  * Merge (bitwise OR) each vector bitset.
  */
 
 bitset_t *bitset_vector_merge(const bitset_vector_t *);
 
+/**
+ * Combine many vectors with the same operation, e.g. to OR together shards.
+ * The vectors are merged in offset order in a single pass, and bitsets that
+ * only appear in one vector are copied as-is.
+ */
+
+bitset_vector_t *bitset_vector_merge_many(bitset_vector_t **, size_t, enum bitset_operation_type);
+
+/**
+ * Roll up the vector into buckets of the specified width, e.g. days into
+ * weeks. Bitsets in each bucket are combined with the specified operation and
+ * stored at the first offset of the bucket.
+ */
+
+bitset_vector_t *bitset_vector_rollup(const bitset_vector_t *, unsigned width,
+    enum bitset_operation_type);
+
+/**
+ * Roll up the vector using a function that maps each offset to the offset of
+ * its bucket. The function must not decrease as offsets increase, and must be
+ * thread-safe when more than one thread is used.
+ */
+
+bitset_vector_t *bitset_vector_rollup_fn(const bitset_vector_t *,
+    unsigned (*bucket_fn)(unsigned, void *), void *context,
+    enum bitset_operation_type, unsigned threads);
+
+/**
+ * Create a new segmented vector. Rather than growing a single buffer, bitsets
+ * are appended to a list of vectors which are each around the specified number
+ * of bytes. Each segment continues from the tail offset of the previous one
+ * and can be read like any other vector.
+ */
+
+bitset_vector_segmented_t *bitset_vector_segmented_new(size_t segment_size);
+
+/**
+ * Free the segmented vector.
+ */
+
+void bitset_vector_segmented_free(bitset_vector_segmented_t *);
+
+/**
+ * Push a bitset on to the end of the segmented vector.
+ */
+
+void bitset_vector_segmented_push(bitset_vector_segmented_t *, const bitset_t *, unsigned);
+
+/**
+ * Get the number of bitsets and the byte length of the segmented vector.
+ */
+
+unsigned bitset_vector_segmented_bitsets(const bitset_vector_segmented_t *);
+size_t bitset_vector_segmented_length(const bitset_vector_segmented_t *);
+
+/**
+ * Find the bitset at the specified offset.
+ */
+
+bool bitset_vector_segmented_get(const bitset_vector_segmented_t *, unsigned offset, bitset_t *);
+
+/**
+ * Concatenate the segments into a contiguous vector.
+ */
+
+bitset_vector_t *bitset_vector_segmented_export(const bitset_vector_segmented_t *);
+
+/**
+ * Create a write buffer in front of a vector. Unlike the vector itself, the
+ * buffer accepts bitsets for any offset; late bitsets are held until the
+ * buffer has the specified number of pending offsets (or forever when the
+ * limit is zero) and then merged into the vector in a single pass.
+ */
+
+bitset_vector_buffer_t *bitset_vector_buffer_new(bitset_vector_t *, size_t limit);
+
+/**
+ * Flush the buffer and free it. The vector isn't freed.
+ */
+
+void bitset_vector_buffer_free(bitset_vector_buffer_t *);
+
+/**
+ * Merge (bitwise OR) a bitset into the bitset at the specified offset.
+ */
+
+void bitset_vector_buffer_push(bitset_vector_buffer_t *, const bitset_t *, unsigned offset);
+
+/**
+ * Set a bit in the bitset at the specified offset.
+ */
+
+void bitset_vector_buffer_set(bitset_vector_buffer_t *, unsigned offset, bitset_offset);
+
+/**
+ * Merge pending bitsets into the vector.
+ */
+
+void bitset_vector_buffer_flush(bitset_vector_buffer_t *);
+
+/**
+ * Run an ordered funnel over a vector per step. A bit reaches the first step
+ * when it's set in any of the first vector's bitsets, and reaches each later
+ * step when it's set in the step's vector at the same offset or up to window
+ * offsets after it reached the previous step. The number of bits reaching
+ * each step is stored in counts (which can be NULL), and the bits that reach
+ * the final step are returned.
+ */
+
+bitset_t *bitset_funnel_exec(bitset_vector_t **vectors, size_t steps, unsigned window,
+    bitset_offset *counts);
+
 /**
  * Create a new vector operation.
  */
@@ -164,6 +469,17 @@ bitset_vector_operation_t *bitset_vector_operation_new(bitset_vector_t *);
 void bitset_vector_operation_free(bitset_vector_operation_t *);
 void bitset_vector_operation_free_operands(bitset_vector_operation_t *);
 
+/**
+ * Count the result of the operation without building the result vector. The
+ * total count is stored in raw, and the offset and count of each non-empty
+ * result bitset are stored in arrays which must be freed with
+ * bitset_malloc_free(). Any of the outputs can be NULL. Returns the number of
+ * non-empty result bitsets.
+ */
+
+size_t bitset_vector_operation_count(bitset_vector_operation_t *, bitset_offset *raw,
+    unsigned **offsets, bitset_offset **counts);
+
 /**
  * Add a vector to the operation.
  */
@@ -171,6 +487,16 @@ void bitset_vector_operation_free_operands(bitset_vector_operation_t *);
 void bitset_vector_operation_add(bitset_vector_operation_t *,
     bitset_vector_t *, enum bitset_operation_type);
 
+/**
+ * Add a vector to the operation with its offsets shifted by the specified
+ * amount, e.g. to line up last week's bitsets with this week's. Bitsets that
+ * would be shifted below offset zero or past UINT_MAX are ignored. Use a view
+ * to restrict the operand to a window.
+ */
+
+void bitset_vector_operation_add_shifted(bitset_vector_operation_t *,
+    bitset_vector_t *, int shift, enum bitset_operation_type);
+
 /**
  * Add a nested operation.
  */
@@ -178,12 +504,29 @@ void bitset_vector_operation_add(bitset_vector_operation_t *,
 void bitset_vector_operation_add_nested(bitset_vector_operation_t *,
     bitset_vector_operation_t *, enum bitset_operation_type);
 
+/**
+ * Only evaluate the operation between start and end. Bitsets outside the range
+ * are skipped rather than decoded, using the operands' directories where they
+ * have one. Nested operations without a range of their own inherit the range
+ * when they're evaluated.
+ */
+
+void bitset_vector_operation_set_range(bitset_vector_operation_t *, unsigned start, unsigned end);
+
 /**
  * Execute the operation and return the result.
  */
 
 bitset_vector_t *bitset_vector_operation_exec(bitset_vector_operation_t *);
 
+/**
+ * Execute the operation using up to the specified number of threads. The
+ * offset range is split into chunks which are evaluated concurrently and then
+ * joined in order. Falls back to a single thread when pthreads is unavailable.
+ */
+
+bitset_vector_t *bitset_vector_operation_exec_parallel(bitset_vector_operation_t *, unsigned threads);
+
 /**
  * Provide a way to associate user data with each step and use the data to lazily
  * lookup vectors.
@@ -195,6 +538,23 @@ void bitset_vector_operation_add_data(bitset_vector_operation_t *,
 void bitset_vector_operation_resolve_data(bitset_vector_operation_t *,
         bitset_vector_t *(*)(void *data, void *context), void *context);
 
+/**
+ * Collect the data of every lazy step, including those in nested operations,
+ * and resolve them with a single call. The callback stores the vector for
+ * data[i] in vectors[i], so loads can be batched or issued concurrently.
+ */
+
+void bitset_vector_operation_resolve_data_bulk(bitset_vector_operation_t *,
+        void (*)(void **data, bitset_vector_t **vectors, size_t count, void *context), void *context);
+
+/**
+ * Resolve lazy steps using up to the specified number of threads. The
+ * callback must be safe to call concurrently.
+ */
+
+void bitset_vector_operation_resolve_data_parallel(bitset_vector_operation_t *,
+        bitset_vector_t *(*)(void *data, void *context), void *context, unsigned threads);
+
 void bitset_vector_operation_free_data(bitset_vector_operation_t *, void (*)(void *data));
 
 /**
@@ -4,43 +4,73 @@
 
 #include "bitset/malloc.h"
 #include "bitset/operation.h"
+#include "cursor.h"
 
 bitset_t *bitset_new() {
     bitset_t *bitset = bitset_malloc(sizeof(bitset_t));
     if (!bitset) {
         bitset_oom();
     }
-    bitset->length = 0;
+    bitset->length = bitset->size = 0;
     bitset->buffer = NULL;
+    bitset->version = 0;
     return bitset;
 }
 
 void bitset_free(bitset_t *bitset) {
-    if (bitset->length) {
+    if (bitset->buffer) {
         bitset_malloc_free(bitset->buffer);
     }
     bitset_malloc_free(bitset);
 }
 
 void bitset_resize(bitset_t *bitset, size_t length) {
-    size_t current_size, next_size;
-    BITSET_NEXT_POW2(next_size, length);
-    if (!bitset->length) {
-        bitset->buffer = bitset_malloc(sizeof(bitset_word) * next_size);
-    } else {
-        BITSET_NEXT_POW2(current_size, bitset->length);
-        if (next_size > current_size) {
+    size_t next_size;
+    bitset_word *borrowed;
+    bitset->version = 0;
+    if (length > bitset->size) {
+        BITSET_NEXT_POW2(next_size, length);
+        if (!bitset->size) {
+            borrowed = bitset->buffer;
+            bitset->buffer = bitset_malloc(sizeof(bitset_word) * next_size);
+            if (borrowed && bitset->buffer && bitset->length) {
+                memcpy(bitset->buffer, borrowed, sizeof(bitset_word) *
+                    (bitset->length < length ? bitset->length : length));
+            }
+        } else {
             bitset->buffer = bitset_realloc(bitset->buffer, sizeof(bitset_word) * next_size);
         }
-    }
-    if (!bitset->buffer) {
-        bitset_oom();
+        if (!bitset->buffer) {
+            bitset_oom();
+        }
+        bitset->size = next_size;
     }
     bitset->length = length;
 }
 
+void bitset_shrink(bitset_t *bitset) {
+    size_t next_size;
+    if (!bitset->length) {
+        if (bitset->size) {
+            bitset_malloc_free(bitset->buffer);
+            bitset->buffer = NULL;
+            bitset->size = 0;
+        }
+        return;
+    }
+    BITSET_NEXT_POW2(next_size, bitset->length);
+    if (next_size < bitset->size) {
+        bitset->buffer = bitset_realloc(bitset->buffer, sizeof(bitset_word) * next_size);
+        if (!bitset->buffer) {
+            bitset_oom();
+        }
+        bitset->size = next_size;
+    }
+}
+
 void bitset_clear(bitset_t *bitset) {
     bitset->length = 0;
+    bitset->version = 0;
 }
 
 size_t bitset_length(const bitset_t *bitset) {
@@ -61,6 +91,7 @@ bitset_t *bitset_copy(const bitset_t *bitset) {
         }
         memcpy(copy->buffer, bitset->buffer, bitset->length * sizeof(bitset_word));
         copy->length = bitset->length;
+        copy->size = size;
     }
     return copy;
 }
@@ -106,25 +137,6 @@ bitset_offset bitset_count(const bitset_t *bitset) {
     return count;
 }
 
-static inline unsigned char bitset_fls(bitset_word word) {
-    static char table[64] = {
-        32, 31, 0, 16, 0, 30, 3, 0, 15, 0, 0, 0, 29, 10, 2, 0,
-        0, 0, 12, 14, 21, 0, 19, 0, 0, 28, 0, 25, 0, 9, 1, 0,
-        17, 0, 4, 0, 0, 0, 11, 0, 13, 22, 20, 0, 26, 0, 0, 18,
-        5, 0, 0, 23, 0, 27, 0, 6, 0, 24, 7, 0, 8, 0, 0, 0
-    };
-    word = word | (word >> 1);
-    word = word | (word >> 2);
-    word = word | (word >> 4);
-    word = word | (word >> 8);
-    word = word | (word >> 16);
-    word = (word << 3) - word;
-    word = (word << 8) - word;
-    word = (word << 8) - word;
-    word = (word << 8) - word;
-    return table[word >> 26] - 1;
-}
-
 static inline unsigned char bitset_ffs(bitset_word word) {
     static char table[32] = {
         0, 1, 28, 2, 29, 14, 24, 3, 30, 22, 20, 15, 25, 17, 4, 8,
@@ -183,6 +195,7 @@ bool bitset_unset(bitset_t *bitset, bitset_offset bit) {
 bool bitset_set_to(bitset_t *bitset, bitset_offset bit, bool value) {
     bitset_offset word_offset = bit / BITSET_LITERAL_LENGTH;
     bit %= BITSET_LITERAL_LENGTH;
+    bitset->version = 0;
     if (bitset->length) {
         bitset_word word;
         bitset_offset fill_length;
@@ -192,6 +205,9 @@ bool bitset_set_to(bitset_t *bitset, bitset_offset bit, bool value) {
             if (BITSET_IS_FILL_WORD(word)) {
                 position = BITSET_GET_POSITION(word);
                 fill_length = BITSET_GET_LENGTH(word);
+                if (!value && word_offset < fill_length) {
+                    return false;
+                }
                 if (word_offset == fill_length - 1) {
                     if (position) {
                         bitset_resize(bitset, bitset->length + 1);
@@ -232,9 +248,31 @@ bool bitset_set_to(bitset_t *bitset, bitset_offset bit, bool value) {
                     if (!word_offset) {
                         if (position == bit + 1) {
                             if (!value) {
-                                bitset->buffer[i] = BITSET_UNSET_POSITION(word);
+                                //Keep the position word when other words follow it. A
+                                //full fill can't grow, so the freed word joins the next
+                                //word or becomes a fill of its own
+                                if (i == bitset->length - 1) {
+                                    bitset->buffer[i] = BITSET_UNSET_POSITION(word);
+                                } else if (fill_length < BITSET_MAX_LENGTH) {
+                                    bitset->buffer[i] = BITSET_CREATE_EMPTY_FILL(fill_length + 1);
+                                } else {
+                                    bitset_word next = bitset->buffer[i+1];
+                                    bitset->buffer[i] = BITSET_UNSET_POSITION(word);
+                                    if (BITSET_IS_FILL_WORD(next) && BITSET_GET_LENGTH(next) < BITSET_MAX_LENGTH) {
+                                        bitset->buffer[i+1] = next + 1;
+                                    } else if (BITSET_IS_LITERAL_WORD(next) && next && BITSET_IS_POW2(next)) {
+                                        bitset->buffer[i+1] = BITSET_CREATE_FILL(1, bitset_fls(next));
+                                    } else {
+                                        bitset_resize(bitset, bitset->length + 1);
+                                        memmove(bitset->buffer+i+2, bitset->buffer+i+1,
+                                            sizeof(bitset_word) * (bitset->length - i - 2));
+                                        bitset->buffer[i+1] = BITSET_CREATE_EMPTY_FILL(1);
+                                    }
+                                }
                             }
                             return true;
+                        } else if (!value) {
+                            return false;
                         } else {
                             bitset_resize(bitset, bitset->length + 1);
                             if (i < bitset->length - 1) {
@@ -251,6 +289,9 @@ bool bitset_set_to(bitset_t *bitset, bitset_offset bit, bool value) {
                     }
                     word_offset--;
                 } else if (!word_offset && i == bitset->length - 1) {
+                    if (!value) {
+                        return false;
+                    }
                     bitset->buffer[i] = BITSET_SET_POSITION(word, bit + 1);
                     return false;
                 }
@@ -296,7 +337,8 @@ bitset_t *bitset_new_buffer(const char *buffer, size_t length) {
         bitset_oom();
     }
     memcpy(bitset->buffer, buffer, length * sizeof(char));
-    bitset->length = length / sizeof(bitset_word);
+    bitset->length = bitset->size = length / sizeof(bitset_word);
+    bitset->version = 0;
     return bitset;
 }
 
@@ -372,6 +414,74 @@ bitset_t *bitset_new_bits(bitset_offset *bits, size_t count) {
     return bitset;
 }
 
+bool bitset_intersects(const bitset_t *a, const bitset_t *b) {
+    bitset_cursor_t a_cursor, b_cursor;
+    bitset_cursor_init(&a_cursor, a->buffer, a->length);
+    bitset_cursor_init(&b_cursor, b->buffer, b->length);
+    bool a_active = bitset_cursor_next(&a_cursor), b_active = bitset_cursor_next(&b_cursor);
+    while (a_active && b_active) {
+        if (a_cursor.offset < b_cursor.offset) {
+            a_active = bitset_cursor_next(&a_cursor);
+        } else if (b_cursor.offset < a_cursor.offset) {
+            b_active = bitset_cursor_next(&b_cursor);
+        } else {
+            if (a_cursor.word & b_cursor.word) {
+                return true;
+            }
+            a_active = bitset_cursor_next(&a_cursor);
+            b_active = bitset_cursor_next(&b_cursor);
+        }
+    }
+    return false;
+}
+
+bool bitset_is_subset(const bitset_t *a, const bitset_t *b) {
+    bitset_cursor_t a_cursor, b_cursor;
+    bitset_cursor_init(&a_cursor, a->buffer, a->length);
+    bitset_cursor_init(&b_cursor, b->buffer, b->length);
+    bool b_active = bitset_cursor_next(&b_cursor);
+    while (bitset_cursor_next(&a_cursor)) {
+        while (b_active && b_cursor.offset < a_cursor.offset) {
+            b_active = bitset_cursor_next(&b_cursor);
+        }
+        if (!a_cursor.word) {
+            continue;
+        }
+        if (!b_active || b_cursor.offset != a_cursor.offset ||
+                (a_cursor.word & ~b_cursor.word)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool bitset_equals(const bitset_t *a, const bitset_t *b) {
+    bitset_cursor_t a_cursor, b_cursor;
+    bitset_cursor_init(&a_cursor, a->buffer, a->length);
+    bitset_cursor_init(&b_cursor, b->buffer, b->length);
+    bool a_active = bitset_cursor_next(&a_cursor), b_active = bitset_cursor_next(&b_cursor);
+    while (a_active || b_active) {
+        if (!b_active || (a_active && a_cursor.offset < b_cursor.offset)) {
+            if (a_cursor.word) {
+                return false;
+            }
+            a_active = bitset_cursor_next(&a_cursor);
+        } else if (!a_active || b_cursor.offset < a_cursor.offset) {
+            if (b_cursor.word) {
+                return false;
+            }
+            b_active = bitset_cursor_next(&b_cursor);
+        } else {
+            if (a_cursor.word != b_cursor.word) {
+                return false;
+            }
+            a_active = bitset_cursor_next(&a_cursor);
+            b_active = bitset_cursor_next(&b_cursor);
+        }
+    }
+    return true;
+}
+
 bitset_iterator_t *bitset_iterator_new(const bitset_t *bitset) {
     bitset_iterator_t *iterator = bitset_malloc(sizeof(bitset_iterator_t));
     if (!iterator) {
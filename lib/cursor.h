@@ -0,0 +1,160 @@
+#ifndef BITSET_CURSOR_H_
+#define BITSET_CURSOR_H_
+
+#include "bitset/bitset.h"
+
+/**
+ * A cursor walks the non-empty words of a bitset, expanding fills with a
+ * position into the literal they stand for. The offset of each word is one
+ * more than its word index. A cursor can also walk words which have already
+ * been decoded into a list of (word offset, word) pairs.
+ */
+
+typedef struct bitset_cursor_s {
+    const bitset_word *buffer;
+    const bitset_offset *offsets;
+    size_t length;
+    size_t position;
+    bitset_offset offset;
+    bitset_offset end;
+    bitset_word word;
+} bitset_cursor_t;
+
+static inline void bitset_cursor_init(bitset_cursor_t *cursor, const bitset_word *buffer, size_t length) {
+    cursor->buffer = buffer;
+    cursor->offsets = NULL;
+    cursor->length = length;
+    cursor->position = 0;
+    cursor->offset = cursor->end = 0;
+    cursor->word = 0;
+}
+
+static inline void bitset_cursor_init_decoded(bitset_cursor_t *cursor, const bitset_offset *offsets,
+        const bitset_word *words, size_t length) {
+    bitset_cursor_init(cursor, words, length);
+    cursor->offsets = offsets;
+}
+
+static inline bool bitset_cursor_next(bitset_cursor_t *cursor) {
+    bitset_word word;
+    unsigned position;
+    if (cursor->offsets) {
+        if (cursor->position >= cursor->length) {
+            return false;
+        }
+        cursor->offset = cursor->offsets[cursor->position];
+        cursor->word = cursor->buffer[cursor->position++];
+        return true;
+    }
+    while (cursor->position < cursor->length) {
+        word = cursor->buffer[cursor->position++];
+        if (BITSET_IS_FILL_WORD(word)) {
+            cursor->offset += BITSET_GET_LENGTH(word);
+            position = BITSET_GET_POSITION(word);
+            if (!position) {
+                continue;
+            }
+            word = BITSET_CREATE_LITERAL(position - 1);
+        }
+        cursor->offset++;
+        cursor->word = word;
+        return true;
+    }
+    return false;
+}
+
+/**
+ * Walk an encoded buffer from the last word to the first.
+ */
+
+static inline void bitset_cursor_init_reverse(bitset_cursor_t *cursor, const bitset_word *buffer,
+        size_t length) {
+    bitset_word word;
+    bitset_cursor_init(cursor, buffer, length);
+    cursor->position = length;
+    for (size_t i = 0; i < length; i++) {
+        word = buffer[i];
+        if (BITSET_IS_FILL_WORD(word)) {
+            cursor->end += BITSET_GET_LENGTH(word) + (BITSET_GET_POSITION(word) != 0);
+        } else {
+            cursor->end++;
+        }
+    }
+}
+
+static inline bool bitset_cursor_prev(bitset_cursor_t *cursor) {
+    bitset_word word;
+    unsigned position;
+    while (cursor->position) {
+        word = cursor->buffer[--cursor->position];
+        if (BITSET_IS_FILL_WORD(word)) {
+            position = BITSET_GET_POSITION(word);
+            if (!position) {
+                cursor->end -= BITSET_GET_LENGTH(word);
+                continue;
+            }
+            cursor->offset = cursor->end;
+            cursor->word = BITSET_CREATE_LITERAL(position - 1);
+            cursor->end -= BITSET_GET_LENGTH(word) + 1;
+            return true;
+        }
+        cursor->offset = cursor->end--;
+        cursor->word = word;
+        return true;
+    }
+    return false;
+}
+
+/**
+ * Find the last set bit in a word.
+ */
+
+static inline unsigned char bitset_fls(bitset_word word) {
+    static char table[64] = {
+        32, 31, 0, 16, 0, 30, 3, 0, 15, 0, 0, 0, 29, 10, 2, 0,
+        0, 0, 12, 14, 21, 0, 19, 0, 0, 28, 0, 25, 0, 9, 1, 0,
+        17, 0, 4, 0, 0, 0, 11, 0, 13, 22, 20, 0, 26, 0, 0, 18,
+        5, 0, 0, 23, 0, 27, 0, 6, 0, 24, 7, 0, 8, 0, 0, 0
+    };
+    word = word | (word >> 1);
+    word = word | (word >> 2);
+    word = word | (word >> 4);
+    word = word | (word >> 8);
+    word = word | (word >> 16);
+    word = (word << 3) - word;
+    word = (word << 8) - word;
+    word = (word << 8) - word;
+    word = (word << 8) - word;
+    return table[word >> 26] - 1;
+}
+
+/**
+ * Append a word to a bitset that's being encoded in offset order. The offset
+ * follows the cursor's convention, and word_offset tracks the offset of the
+ * previous word appended.
+ */
+
+static inline void bitset_cursor_append(bitset_t *bitset, bitset_offset *word_offset,
+        bitset_offset offset, bitset_word word) {
+    bitset_offset fills = (offset - *word_offset - 1) / BITSET_MAX_LENGTH;
+    size_t length = bitset->length;
+    if (length + fills + 2 > bitset->size) {
+        bitset_resize(bitset, length + fills + 2);
+        bitset->length = length;
+    }
+    for (bitset_offset i = 0; i < fills; i++) {
+        bitset->buffer[bitset->length++] = BITSET_CREATE_EMPTY_FILL(BITSET_MAX_LENGTH);
+    }
+    *word_offset += fills * BITSET_MAX_LENGTH;
+    if (offset - *word_offset == 1) {
+        bitset->buffer[bitset->length++] = word;
+    } else if (BITSET_IS_POW2(word)) {
+        bitset->buffer[bitset->length++] = BITSET_CREATE_FILL(offset - *word_offset - 1, bitset_fls(word));
+    } else {
+        bitset->buffer[bitset->length++] = BITSET_CREATE_EMPTY_FILL(offset - *word_offset - 1);
+        bitset->buffer[bitset->length++] = word;
+    }
+    *word_offset = offset;
+}
+
+#endif
@@ -1,6 +1,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <assert.h>
+#include <math.h>
 
 #include "bitset/malloc.h"
 #include "bitset/estimate.h"
@@ -192,3 +193,86 @@ void bitset_countn_free(bitset_countn_t *counter) {
     bitset_malloc_free(counter);
 }
 
+bitset_hll_t *bitset_hll_new(double error) {
+    bitset_hll_t *counter = bitset_malloc(sizeof(bitset_hll_t));
+    if (!counter) {
+        bitset_oom();
+    }
+    //An error of zero or less asks for the most precise sketch
+    double registers = error > 0 ? (1.04 / error) * (1.04 / error) : 1 << 18;
+    counter->precision = registers > 16 ? (unsigned) ceil(log2(registers)) : 4;
+    if (counter->precision > 18) {
+        counter->precision = 18;
+    }
+    counter->size = (size_t) 1 << counter->precision;
+    counter->registers = bitset_calloc(1, counter->size);
+    if (!counter->registers) {
+        bitset_oom();
+    }
+    return counter;
+}
+
+static inline void bitset_hll_add_bit(bitset_hll_t *counter, uint64_t bit) {
+    uint64_t hash = bit + 0x9E3779B97F4A7C15ULL;
+    hash = (hash ^ (hash >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    hash = (hash ^ (hash >> 27)) * 0x94D049BB133111EBULL;
+    hash ^= hash >> 31;
+    size_t index = hash >> (64 - counter->precision);
+    unsigned char rank = 1;
+    hash <<= counter->precision;
+    while (rank <= 64 - counter->precision && !(hash & 0x8000000000000000ULL)) {
+        hash <<= 1;
+        rank++;
+    }
+    if (rank > counter->registers[index]) {
+        counter->registers[index] = rank;
+    }
+}
+
+void bitset_hll_add(bitset_hll_t *counter, const bitset_t *bitset) {
+    uint64_t offset = 0;
+    bitset_word word;
+    unsigned position;
+    for (size_t i = 0; i < bitset->length; i++) {
+        word = bitset->buffer[i];
+        if (BITSET_IS_FILL_WORD(word)) {
+            offset += BITSET_GET_LENGTH(word);
+            position = BITSET_GET_POSITION(word);
+            if (position) {
+                bitset_hll_add_bit(counter, offset * BITSET_LITERAL_LENGTH + position - 1);
+            }
+        } else {
+            for (unsigned x = 0; x < BITSET_LITERAL_LENGTH; x++) {
+                if (word & ((bitset_word) 1 << x)) {
+                    bitset_hll_add_bit(counter, offset * BITSET_LITERAL_LENGTH + BITSET_LITERAL_LENGTH - 1 - x);
+                }
+            }
+        }
+        offset++;
+    }
+}
+
+unsigned bitset_hll_count(const bitset_hll_t *counter) {
+    double m = counter->size, sum = 0, alpha, estimate;
+    unsigned zeros = 0;
+    for (size_t i = 0; i < counter->size; i++) {
+        sum += 1.0 / ((uint64_t) 1 << counter->registers[i]);
+        zeros += !counter->registers[i];
+    }
+    switch (counter->size) {
+        case 16: alpha = 0.673; break;
+        case 32: alpha = 0.697; break;
+        case 64: alpha = 0.709; break;
+        default: alpha = 0.7213 / (1 + 1.079 / m); break;
+    }
+    estimate = alpha * m * m / sum;
+    if (estimate <= 2.5 * m && zeros) {
+        estimate = m * log(m / zeros);
+    }
+    return (unsigned) (estimate + 0.5);
+}
+
+void bitset_hll_free(bitset_hll_t *counter) {
+    bitset_malloc_free(counter->registers);
+    bitset_malloc_free(counter);
+}
@@ -1,15 +1,21 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "bitset/malloc.h"
 #include "bitset/operation.h"
+#include "cursor.h"
 
 bitset_operation_t *bitset_operation_new(bitset_t *bitset) {
     bitset_operation_t *operation = bitset_malloc(sizeof(bitset_operation_t));
     if (!operation) {
         bitset_oom();
     }
+    operation->steps = NULL;
     operation->length = 0;
+    operation->cache = NULL;
+    operation->fingerprint = NULL;
+    operation->fingerprint_length = 0;
     if (bitset) {
         bitset_operation_add(operation, bitset, BITSET_OR);
     }
@@ -28,6 +34,7 @@ void bitset_operation_free(bitset_operation_t *operation) {
         bitset_malloc_free(operation->steps[i]);
     }
     bitset_malloc_free(operation->steps);
+    bitset_malloc_free(operation->fingerprint);
     bitset_malloc_free(operation);
 }
 
@@ -36,6 +43,11 @@ static inline bitset_operation_step_t *bitset_operation_add_step(bitset_operatio
     if (!step) {
         bitset_oom();
     }
+    step->source = NULL;
+    if (operation->fingerprint) {
+        bitset_malloc_free(operation->fingerprint);
+        operation->fingerprint = NULL;
+    }
     if (operation->length % 2 == 0) {
         if (!operation->length) {
             operation->steps = bitset_malloc(sizeof(bitset_operation_step_t *) * 2);
@@ -57,6 +69,8 @@ void bitset_operation_add_buffer(bitset_operation_t *operation,
                 bitset_malloc_free(operation->steps[i]);
             }
             operation->length = 0;
+            bitset_malloc_free(operation->fingerprint);
+            operation->fingerprint = NULL;
         }
         return;
     }
@@ -65,12 +79,28 @@ void bitset_operation_add_buffer(bitset_operation_t *operation,
     step->is_operation = false;
     step->data.bitset.buffer = buffer;
     step->data.bitset.length = length;
+    step->data.bitset.size = 0;
+    step->data.bitset.version = 0;
     step->type = type;
 }
 
+static uint64_t bitset_operation_version = 0;
+
+static inline uint64_t bitset_operation_next_version(void) {
+#if defined(__GNUC__)
+    return __sync_add_and_fetch(&bitset_operation_version, 1);
+#else
+    return ++bitset_operation_version;
+#endif
+}
+
 void bitset_operation_add(bitset_operation_t *operation,
         bitset_t *bitset, enum bitset_operation_type type) {
+    size_t length = operation->length;
     bitset_operation_add_buffer(operation, bitset->buffer, bitset->length, type);
+    if (operation->length > length) {
+        operation->steps[length]->source = bitset;
+    }
 }
 
 void bitset_operation_add_nested(bitset_operation_t *operation, bitset_operation_t *nested,
@@ -207,29 +237,345 @@ static inline bitset_word *bitset_hash_get(const bitset_hash_t *hash, bitset_off
     return NULL;
 }
 
-static inline bitset_hash_t *bitset_operation_iter(bitset_operation_t *operation) {
-    bitset_offset word_offset, max = 0, b_max, length, and_offset;
+/**
+ * Operands which are shared by the operations in a batch are decoded once
+ * into a list of (word offset, word) pairs.
+ */
+
+typedef struct bitset_operation_words_s {
+    bitset_offset *offsets;
+    bitset_word *words;
+    size_t length;
+} bitset_operation_words_t;
+
+static inline void bitset_operation_cursor_init(bitset_cursor_t *cursor,
+        const bitset_t *bitset, const bitset_operation_words_t *decoded) {
+    if (decoded) {
+        bitset_cursor_init_decoded(cursor, decoded->offsets, decoded->words, decoded->length);
+    } else {
+        bitset_cursor_init(cursor, bitset->buffer, bitset->length);
+    }
+}
+
+static inline bitset_operation_words_t *bitset_operation_words_new(const bitset_t *bitset) {
+    bitset_operation_words_t *decoded = bitset_malloc(sizeof(bitset_operation_words_t));
+    if (!decoded) {
+        bitset_oom();
+    }
+    decoded->length = 0;
+    decoded->offsets = bitset_malloc(sizeof(bitset_offset) * (bitset->length + 1));
+    decoded->words = bitset_malloc(sizeof(bitset_word) * (bitset->length + 1));
+    if (!decoded->offsets || !decoded->words) {
+        bitset_oom();
+    }
+    bitset_cursor_t cursor;
+    bitset_operation_cursor_init(&cursor, bitset, NULL);
+    while (bitset_cursor_next(&cursor)) {
+        decoded->offsets[decoded->length] = cursor.offset;
+        decoded->words[decoded->length++] = cursor.word;
+    }
+    return decoded;
+}
+
+static inline void bitset_operation_words_free(bitset_operation_words_t *decoded) {
+    bitset_malloc_free(decoded->offsets);
+    bitset_malloc_free(decoded->words);
+    bitset_malloc_free(decoded);
+}
+
+bitset_operation_cache_t *bitset_operation_cache_new(size_t max_bytes) {
+    bitset_operation_cache_t *cache = bitset_malloc(sizeof(bitset_operation_cache_t));
+    if (!cache) {
+        bitset_oom();
+    }
+    cache->size = 16;
+    cache->buckets = bitset_calloc(1, sizeof(bitset_operation_cache_entry_t *) * cache->size);
+    if (!cache->buckets) {
+        bitset_oom();
+    }
+    cache->newest = cache->oldest = NULL;
+    cache->count = cache->bytes = 0;
+    cache->max_bytes = max_bytes;
+    cache->hits = cache->misses = 0;
+    return cache;
+}
+
+void bitset_operation_cache_free(bitset_operation_cache_t *cache) {
+    bitset_operation_cache_entry_t *entry = cache->newest, *tmp;
+    while (entry) {
+        tmp = entry;
+        entry = entry->older;
+        bitset_malloc_free(tmp->bitset.buffer);
+        bitset_malloc_free(tmp->fingerprint);
+        bitset_malloc_free(tmp);
+    }
+    bitset_malloc_free(cache->buckets);
+    bitset_malloc_free(cache);
+}
+
+void bitset_operation_set_cache(bitset_operation_t *operation, bitset_operation_cache_t *cache) {
+    operation->cache = cache;
+}
+
+/**
+ * An operation's fingerprint lists the type, version and length of each
+ * operand and the fingerprints of nested operations. It's computed once per
+ * operation and a fingerprint of length one means the operation can't be
+ * cached because an operand has no version.
+ */
+
+static const uint64_t *bitset_operation_fingerprint(bitset_operation_t *operation) {
     bitset_operation_step_t *step;
-    bitset_word word = 0, *hashed, and_word;
-    unsigned position, count = 0, k, j;
-    int last_k, last_j;
-    size_t size, start_at;
-    bitset_hash_t *words, *and_words = NULL;
-    bitset_t *tmp, *bitset, *and;
+    const uint64_t *nested;
+    size_t length = 1;
+    bool cacheable = true;
+    if (operation->fingerprint) {
+        return operation->fingerprint;
+    }
+    for (size_t i = 0; i < operation->length; i++) {
+        step = operation->steps[i];
+        if (step->is_operation) {
+            nested = bitset_operation_fingerprint(step->data.nested);
+            cacheable = cacheable && step->data.nested->fingerprint_length > 1;
+            length += 2 + step->data.nested->fingerprint_length;
+        } else {
+            //Versions are only needed for caching, so they're assigned here
+            //rather than when the bitset is added
+            if (!step->data.bitset.version && step->source) {
+                if (!step->source->version) {
+                    step->source->version = bitset_operation_next_version();
+                }
+                step->data.bitset.version = step->source->version;
+            }
+            cacheable = cacheable && step->data.bitset.version;
+            length += 3;
+        }
+    }
+    if (!cacheable) {
+        length = 1;
+    }
+    operation->fingerprint = bitset_malloc(sizeof(uint64_t) * length);
+    if (!operation->fingerprint) {
+        bitset_oom();
+    }
+    operation->fingerprint_length = length;
+    operation->fingerprint[0] = operation->length;
+    if (!cacheable) {
+        return operation->fingerprint;
+    }
+    length = 1;
+    for (size_t i = 0; i < operation->length; i++) {
+        step = operation->steps[i];
+        if (step->is_operation) {
+            nested = step->data.nested->fingerprint;
+            operation->fingerprint[length++] = step->type | 0x100;
+            operation->fingerprint[length++] = step->data.nested->fingerprint_length;
+            memcpy(operation->fingerprint + length, nested,
+                sizeof(uint64_t) * step->data.nested->fingerprint_length);
+            length += step->data.nested->fingerprint_length;
+        } else {
+            operation->fingerprint[length++] = step->type;
+            operation->fingerprint[length++] = step->data.bitset.version;
+            operation->fingerprint[length++] = step->data.bitset.length;
+        }
+    }
+    return operation->fingerprint;
+}
 
-    //Recursively flatten nested operations
+static inline uint64_t bitset_operation_cache_key(const uint64_t *fingerprint, size_t length) {
+    uint64_t key = 0xCBF29CE484222325ULL;
+    for (size_t i = 0; i < length; i++) {
+        key = (key ^ fingerprint[i]) * 0x100000001B3ULL;
+    }
+    return key;
+}
+
+static inline size_t bitset_operation_cache_bytes(const bitset_operation_cache_entry_t *entry) {
+    return sizeof(bitset_operation_cache_entry_t) + entry->bitset.length * sizeof(bitset_word)
+        + entry->fingerprint_length * sizeof(uint64_t);
+}
+
+static inline void bitset_operation_cache_unlink(bitset_operation_cache_t *cache,
+        bitset_operation_cache_entry_t *entry) {
+    if (entry->newer) {
+        entry->newer->older = entry->older;
+    } else {
+        cache->newest = entry->older;
+    }
+    if (entry->older) {
+        entry->older->newer = entry->newer;
+    } else {
+        cache->oldest = entry->newer;
+    }
+}
+
+static inline void bitset_operation_cache_link(bitset_operation_cache_t *cache,
+        bitset_operation_cache_entry_t *entry) {
+    entry->newer = NULL;
+    entry->older = cache->newest;
+    if (cache->newest) {
+        cache->newest->newer = entry;
+    } else {
+        cache->oldest = entry;
+    }
+    cache->newest = entry;
+}
+
+static inline void bitset_operation_cache_evict(bitset_operation_cache_t *cache) {
+    bitset_operation_cache_entry_t *entry = cache->oldest, **chain;
+    bitset_operation_cache_unlink(cache, entry);
+    chain = &cache->buckets[entry->key & (cache->size - 1)];
+    while (*chain != entry) {
+        chain = &(*chain)->next;
+    }
+    *chain = entry->next;
+    cache->bytes -= bitset_operation_cache_bytes(entry);
+    cache->count--;
+    bitset_malloc_free(entry->bitset.buffer);
+    bitset_malloc_free(entry->fingerprint);
+    bitset_malloc_free(entry);
+}
+
+static inline bitset_operation_cache_entry_t *bitset_operation_cache_get(
+        bitset_operation_cache_t *cache, uint64_t key, const uint64_t *fingerprint, size_t length) {
+    bitset_operation_cache_entry_t *entry = cache->buckets[key & (cache->size - 1)];
+    while (entry) {
+        if (entry->key == key && entry->fingerprint_length == length
+                && !memcmp(entry->fingerprint, fingerprint, sizeof(uint64_t) * length)) {
+            bitset_operation_cache_unlink(cache, entry);
+            bitset_operation_cache_link(cache, entry);
+            cache->hits++;
+            return entry;
+        }
+        entry = entry->next;
+    }
+    cache->misses++;
+    return NULL;
+}
+
+static inline void bitset_operation_cache_put(bitset_operation_cache_t *cache,
+        uint64_t key, const uint64_t *fingerprint, size_t length, const bitset_t *bitset) {
+    bitset_operation_cache_entry_t *entry, *next, **buckets;
+    size_t bytes = sizeof(bitset_operation_cache_entry_t) + bitset->length * sizeof(bitset_word)
+        + length * sizeof(uint64_t);
+    if (bytes > cache->max_bytes) {
+        return;
+    }
+    while (cache->bytes + bytes > cache->max_bytes) {
+        bitset_operation_cache_evict(cache);
+    }
+    if (cache->count >= cache->size) {
+        buckets = bitset_calloc(1, sizeof(bitset_operation_cache_entry_t *) * cache->size * 2);
+        if (!buckets) {
+            bitset_oom();
+        }
+        for (size_t i = 0; i < cache->size; i++) {
+            for (entry = cache->buckets[i]; entry; entry = next) {
+                next = entry->next;
+                entry->next = buckets[entry->key & (cache->size * 2 - 1)];
+                buckets[entry->key & (cache->size * 2 - 1)] = entry;
+            }
+        }
+        bitset_malloc_free(cache->buckets);
+        cache->buckets = buckets;
+        cache->size *= 2;
+    }
+    entry = bitset_malloc(sizeof(bitset_operation_cache_entry_t));
+    if (!entry) {
+        bitset_oom();
+    }
+    entry->key = key;
+    entry->fingerprint = bitset_malloc(sizeof(uint64_t) * length);
+    if (!entry->fingerprint) {
+        bitset_oom();
+    }
+    memcpy(entry->fingerprint, fingerprint, sizeof(uint64_t) * length);
+    entry->fingerprint_length = length;
+    entry->bitset.length = entry->bitset.size = bitset->length;
+    entry->bitset.version = 0;
+    entry->bitset.buffer = NULL;
+    if (bitset->length) {
+        entry->bitset.buffer = bitset_malloc(sizeof(bitset_word) * bitset->length);
+        if (!entry->bitset.buffer) {
+            bitset_oom();
+        }
+        memcpy(entry->bitset.buffer, bitset->buffer, sizeof(bitset_word) * bitset->length);
+    }
+    entry->next = cache->buckets[key & (cache->size - 1)];
+    cache->buckets[key & (cache->size - 1)] = entry;
+    bitset_operation_cache_link(cache, entry);
+    cache->bytes += bytes;
+    cache->count++;
+}
+
+static inline void bitset_operation_flatten(bitset_operation_t *operation) {
+    bitset_operation_t *nested;
+    bitset_operation_cache_entry_t *cached;
+    const uint64_t *fingerprint = NULL;
+    bitset_t *tmp;
+    uint64_t key = 0;
+    size_t length = 0;
     for (size_t i = 0; i < operation->length; i++) {
         if (operation->steps[i]->is_operation) {
-            tmp = bitset_operation_exec(operation->steps[i]->data.nested);
-            bitset_operation_free(operation->steps[i]->data.nested);
+            nested = operation->steps[i]->data.nested;
+            cached = NULL;
+            length = 0;
+            if (operation->cache) {
+                if (!nested->cache) {
+                    nested->cache = operation->cache;
+                }
+                fingerprint = bitset_operation_fingerprint(nested);
+                if (nested->fingerprint_length > 1) {
+                    length = nested->fingerprint_length;
+                    key = bitset_operation_cache_key(fingerprint, length);
+                    cached = bitset_operation_cache_get(operation->cache, key, fingerprint, length);
+                }
+            }
+            if (cached) {
+                tmp = bitset_copy(&cached->bitset);
+            } else {
+                tmp = bitset_operation_exec(nested);
+                if (length) {
+                    bitset_operation_cache_put(operation->cache, key, fingerprint, length, tmp);
+                }
+            }
+            bitset_operation_free(nested);
             operation->steps[i]->data.bitset.buffer = tmp->buffer;
             operation->steps[i]->data.bitset.length = tmp->length;
+            operation->steps[i]->data.bitset.size = tmp->size;
+            operation->steps[i]->data.bitset.version = 0;
             operation->steps[i]->is_operation = false;
             bitset_malloc_free(tmp);
         }
-        count += operation->steps[i]->data.bitset.length;
-        b_max = bitset_max(&operation->steps[i]->data.bitset);
-        max = BITSET_MAX(max, b_max);
+    }
+}
+
+static inline bitset_hash_t *bitset_operation_iter(bitset_operation_t *operation,
+        bitset_operation_words_t **decoded) {
+    bitset_offset max = 0, b_max;
+    bitset_operation_step_t *step;
+    bitset_cursor_t cursor, and_cursor;
+    bitset_word *hashed, word;
+    unsigned count = 0;
+    bool has_word, has_and_word;
+    size_t size, start_at;
+    bitset_hash_t *words, *and_words = NULL;
+
+    //Recursively flatten nested operations
+    bitset_operation_flatten(operation);
+
+    for (size_t i = 0; i < operation->length; i++) {
+        if (decoded && decoded[i]) {
+            count += decoded[i]->length;
+            if (decoded[i]->length) {
+                b_max = decoded[i]->offsets[decoded[i]->length - 1] * BITSET_LITERAL_LENGTH - 1;
+                max = BITSET_MAX(max, b_max);
+            }
+        } else {
+            count += operation->steps[i]->data.bitset.length;
+            b_max = bitset_max(&operation->steps[i]->data.bitset);
+            max = BITSET_MAX(max, b_max);
+        }
     }
 
     //Work out the number of hash buckets to allocate
@@ -247,141 +593,66 @@ static inline bitset_hash_t *bitset_operation_iter(bitset_operation_t *operation
     }
     words = bitset_hash_new(size);
     start_at = 1;
-    bitset = &operation->steps[0]->data.bitset;
-    word_offset = 0;
+    bitset_operation_cursor_init(&cursor, &operation->steps[0]->data.bitset,
+        decoded ? decoded[0] : NULL);
 
     //Compute (0 OR (A AND B)) instead of the usual ((0 OR A) AND B)
     if (operation->length >= 2 && operation->steps[1]->type == BITSET_AND) {
         start_at = 2;
-        and_offset = 0;
-        and_word = 0;
-        and = &operation->steps[1]->data.bitset;
-        k = 0;
-        j = 0;
-        last_k = -1;
-        last_j = -1;
-        while (1) {
-            if (last_j < (int)j && j < and->length) {
-                if (BITSET_IS_FILL_WORD(and->buffer[j])) {
-                    and_offset += BITSET_GET_LENGTH(and->buffer[j]);
-                    position = BITSET_GET_POSITION(and->buffer[j]);
-                    if (!position) {
-                        j++;
-                        continue;
-                    }
-                    and_word = BITSET_CREATE_LITERAL(position - 1);
-                } else {
-                    and_word = and->buffer[j];
-                }
-                and_offset++;
-                last_j = j;
-            }
-            if (last_k < (int)k && k < bitset->length) {
-                if (BITSET_IS_FILL_WORD(bitset->buffer[k])) {
-                    length = BITSET_GET_LENGTH(bitset->buffer[k]);
-                    word_offset += length;
-                    position = BITSET_GET_POSITION(bitset->buffer[k]);
-                    if (!position) {
-                        k++;
-                        continue;
-                    }
-                    word = BITSET_CREATE_LITERAL(position - 1);
-                } else {
-                    word = bitset->buffer[k];
-                }
-                word_offset++;
-                last_k = k;
-            }
-            if (and_offset < word_offset) {
-                if (j++ >= and->length) {
-                    break;
-                }
-            } else if (word_offset < and_offset) {
-                if (k++ >= bitset->length) {
-                    break;
-                }
+        bitset_operation_cursor_init(&and_cursor, &operation->steps[1]->data.bitset,
+            decoded ? decoded[1] : NULL);
+        has_word = bitset_cursor_next(&cursor);
+        has_and_word = bitset_cursor_next(&and_cursor);
+        while (has_word && has_and_word) {
+            if (cursor.offset < and_cursor.offset) {
+                has_word = bitset_cursor_next(&cursor);
+            } else if (and_cursor.offset < cursor.offset) {
+                has_and_word = bitset_cursor_next(&and_cursor);
             } else {
-                word &= and_word;
+                word = cursor.word & and_cursor.word;
                 if (word) {
-                    bitset_hash_insert(words, word_offset, word);
-                }
-                j++;
-                k++;
-                if (j >= and->length && k >= bitset->length) {
-                    break;
+                    bitset_hash_insert(words, cursor.offset, word);
                 }
+                has_word = bitset_cursor_next(&cursor);
+                has_and_word = bitset_cursor_next(&and_cursor);
             }
         }
     } else {
         //Populate the offset=>word hash (0 OR A)
-        for (size_t i = 0; i < bitset->length; i++) {
-            word = bitset->buffer[i];
-            if (BITSET_IS_FILL_WORD(word)) {
-                length = BITSET_GET_LENGTH(word);
-                word_offset += length;
-                position = BITSET_GET_POSITION(word);
-                if (!position) {
-                    continue;
-                }
-                word = BITSET_CREATE_LITERAL(position - 1);
-            }
-            word_offset++;
-            bitset_hash_insert(words, word_offset, word);
+        while (bitset_cursor_next(&cursor)) {
+            bitset_hash_insert(words, cursor.offset, cursor.word);
         }
     }
 
     //Apply the remaining steps in the operation
     for (size_t i = start_at; i < operation->length; i++) {
         step = operation->steps[i];
-        bitset = &step->data.bitset;
-        word_offset = 0;
+        bitset_operation_cursor_init(&cursor, &step->data.bitset, decoded ? decoded[i] : NULL);
         if (step->type == BITSET_AND) {
             and_words = bitset_hash_new(words->size);
-            for (size_t j = 0; j < bitset->length; j++) {
-                word = bitset->buffer[j];
-                if (BITSET_IS_FILL_WORD(word)) {
-                    length = BITSET_GET_LENGTH(word);
-                    word_offset += length;
-                    position = BITSET_GET_POSITION(word);
-                    if (!position) {
-                        continue;
-                    }
-                    word = BITSET_CREATE_LITERAL(position - 1);
-                }
-                word_offset++;
-                hashed = bitset_hash_get(words, word_offset);
+            while (bitset_cursor_next(&cursor)) {
+                hashed = bitset_hash_get(words, cursor.offset);
                 if (hashed && *hashed) {
-                    word &= *hashed;
+                    word = cursor.word & *hashed;
                     if (word) {
-                        bitset_hash_insert(and_words, word_offset, word);
+                        bitset_hash_insert(and_words, cursor.offset, word);
                     }
                 }
             }
             bitset_hash_free(words);
             words = and_words;
         } else {
-            for (size_t j = 0; j < bitset->length; j++) {
-                word = bitset->buffer[j];
-                if (BITSET_IS_FILL_WORD(word)) {
-                    length = BITSET_GET_LENGTH(word);
-                    word_offset += length;
-                    position = BITSET_GET_POSITION(word);
-                    if (!position) {
-                        continue;
-                    }
-                    word = BITSET_CREATE_LITERAL(position - 1);
-                }
-                word_offset++;
-                hashed = bitset_hash_get(words, word_offset);
+            while (bitset_cursor_next(&cursor)) {
+                hashed = bitset_hash_get(words, cursor.offset);
                 if (hashed) {
                     switch (step->type) {
-                        case BITSET_OR:     *hashed |= word;  break;
-                        case BITSET_ANDNOT: *hashed &= ~word; break;
-                        case BITSET_XOR:    *hashed ^= word;  break;
+                        case BITSET_OR:     *hashed |= cursor.word;  break;
+                        case BITSET_ANDNOT: *hashed &= ~cursor.word; break;
+                        case BITSET_XOR:    *hashed ^= cursor.word;  break;
                         default: break;
                     }
                 } else if (step->type != BITSET_ANDNOT) {
-                    bitset_hash_insert(words, word_offset, word);
+                    bitset_hash_insert(words, cursor.offset, cursor.word);
                 }
             }
         }
@@ -405,39 +676,13 @@ static inline void bitset_operation_insertion_sort(bitset_offset *offsets, size_
     }
 }
 
-static inline unsigned char bitset_fls(bitset_word word) {
-    static char table[64] = {
-        32, 31, 0, 16, 0, 30, 3, 0, 15, 0, 0, 0, 29, 10, 2, 0,
-        0, 0, 12, 14, 21, 0, 19, 0, 0, 28, 0, 25, 0, 9, 1, 0,
-        17, 0, 4, 0, 0, 0, 11, 0, 13, 22, 20, 0, 26, 0, 0, 18,
-        5, 0, 0, 23, 0, 27, 0, 6, 0, 24, 7, 0, 8, 0, 0, 0
-    };
-    word = word | (word >> 1);
-    word = word | (word >> 2);
-    word = word | (word >> 4);
-    word = word | (word >> 8);
-    word = word | (word >> 16);
-    word = (word << 3) - word;
-    word = (word << 8) - word;
-    word = (word << 8) - word;
-    word = (word << 8) - word;
-    return table[word >> 26] - 1;
-}
-
-bitset_t *bitset_operation_exec(bitset_operation_t *operation) {
-    if (!operation->length) {
-        return bitset_new();
-    } else if (operation->length == 1 && !operation->steps[0]->is_operation) {
-        return bitset_copy(&operation->steps[0]->data.bitset);
-    }
-    bitset_hash_t *words = bitset_operation_iter(operation);
+static inline void bitset_operation_encode(bitset_hash_t *words, bitset_t *result) {
     bitset_hash_bucket_t *bucket;
-    bitset_t *result = bitset_new();
-    bitset_offset word_offset = 0, fills, offset;
-    bitset_word word, *hashed, fill = BITSET_CREATE_EMPTY_FILL(BITSET_MAX_LENGTH);
+    bitset_offset word_offset = 0, offset;
+    bitset_word word, *hashed;
+    result->length = 0;
     if (!words->count) {
-        bitset_hash_free(words);
-        return result;
+        return;
     }
     bitset_offset *offsets = bitset_malloc(sizeof(bitset_offset) * words->count);
     if (!offsets) {
@@ -459,56 +704,373 @@ bitset_t *bitset_operation_exec(bitset_operation_t *operation) {
     } else {
         qsort(offsets, words->count, sizeof(bitset_offset), bitset_operation_quick_sort);
     }
-    for (size_t i = 0, pos = 0; i < words->count; i++) {
+
+    //Reserve enough capacity for the worst case: a fill and literal per
+    //word plus the fills required to span the gaps between them
+    bitset_resize(result, words->count * 2 + offsets[words->count - 1] / BITSET_MAX_LENGTH);
+    result->length = 0;
+
+    for (size_t i = 0; i < words->count; i++) {
         offset = offsets[i];
         hashed = bitset_hash_get(words, offset);
         word = *hashed;
         if (!word) continue;
-        if (offset - word_offset == 1) {
-            bitset_resize(result, result->length + 1);
-            result->buffer[pos++] = word;
-        } else {
-            if (offset - word_offset > BITSET_MAX_LENGTH) {
-                fills = (offset - word_offset) / BITSET_MAX_LENGTH;
-                bitset_resize(result, result->length + fills);
-                for (bitset_offset i = 0; i < fills; i++) {
-                    result->buffer[pos++] = fill;
-                }
-                word_offset += fills * BITSET_MAX_LENGTH;
-            }
-            if (BITSET_IS_POW2(word)) {
-                bitset_resize(result, result->length + 1);
-                result->buffer[pos++] = BITSET_CREATE_FILL(offset - word_offset - 1,
-                    bitset_fls(word));
-            } else {
-                bitset_resize(result, result->length + 2);
-                result->buffer[pos++] = BITSET_CREATE_EMPTY_FILL(offset - word_offset - 1);
-                result->buffer[pos++] = word;
-            }
-        }
-        word_offset = offset;
+        bitset_cursor_append(result, &word_offset, offset, word);
     }
     bitset_malloc_free(offsets);
-    bitset_hash_free(words);
-    return result;
 }
 
-bitset_offset bitset_operation_count(bitset_operation_t *operation) {
+static inline bitset_offset bitset_operation_popcount(const bitset_hash_t *words) {
     bitset_offset count = 0;
-    bitset_hash_t *words = bitset_operation_iter(operation);
+    bitset_word word;
     for (size_t i = 0; i < words->size; i++) {
         bitset_hash_bucket_t *bucket = words->buckets[i];
         if (BITSET_IS_TAGGED_POINTER(bucket)) {
-            bitset_word word = words->buffer[i];
+            word = words->buffer[i];
             BITSET_POP_COUNT(count, word);
             continue;
         }
         while (bucket) {
-            BITSET_POP_COUNT(count, bucket->word);
+            word = bucket->word;
+            BITSET_POP_COUNT(count, word);
             bucket = bucket->next;
         }
     }
+    return count;
+}
+
+static inline void bitset_operation_exec_decoded(bitset_operation_t *operation,
+        bitset_operation_words_t **decoded, bitset_t *result) {
+    if (!operation->length) {
+        result->length = 0;
+        return;
+    } else if (operation->length == 1 && !operation->steps[0]->is_operation) {
+        bitset_t *bitset = &operation->steps[0]->data.bitset;
+        size_t length = bitset->length;
+        if (result->buffer != bitset->buffer) {
+            bitset_resize(result, length);
+            memcpy(result->buffer, bitset->buffer, length * sizeof(bitset_word));
+        }
+        result->length = length;
+        return;
+    }
+    bitset_hash_t *words = bitset_operation_iter(operation, decoded);
+    bitset_operation_encode(words, result);
+    bitset_hash_free(words);
+}
+
+static inline bitset_offset bitset_operation_count_decoded(bitset_operation_t *operation,
+        bitset_operation_words_t **decoded) {
+    if (!operation->length) {
+        return 0;
+    }
+    bitset_hash_t *words = bitset_operation_iter(operation, decoded);
+    bitset_offset count = bitset_operation_popcount(words);
     bitset_hash_free(words);
     return count;
 }
 
+bitset_t *bitset_operation_exec(bitset_operation_t *operation) {
+    bitset_t *result = bitset_new();
+    bitset_operation_exec_decoded(operation, NULL, result);
+    bitset_shrink(result);
+    return result;
+}
+
+void bitset_operation_exec_into(bitset_operation_t *operation, bitset_t *result) {
+    bitset_operation_exec_decoded(operation, NULL, result);
+}
+
+bitset_offset bitset_operation_count(bitset_operation_t *operation) {
+    return bitset_operation_count_decoded(operation, NULL);
+}
+
+typedef struct bitset_operation_operand_s {
+    const bitset_t *bitset;
+    bitset_operation_words_t **decoded;
+} bitset_operation_operand_t;
+
+static int bitset_operation_operand_sort(const void *a, const void *b) {
+    const bitset_t *a_bitset = ((const bitset_operation_operand_t *)a)->bitset;
+    const bitset_t *b_bitset = ((const bitset_operation_operand_t *)b)->bitset;
+    uintptr_t a_buffer = (uintptr_t)a_bitset->buffer, b_buffer = (uintptr_t)b_bitset->buffer;
+    if (a_buffer != b_buffer) {
+        return a_buffer < b_buffer ? -1 : 1;
+    }
+    return a_bitset->length < b_bitset->length ? -1 : a_bitset->length > b_bitset->length;
+}
+
+static bitset_operation_words_t ***bitset_operation_batch_decode(bitset_operation_t **operations,
+        size_t count, bitset_operation_words_t ***shared, size_t *shared_length) {
+    bitset_operation_words_t ***decoded = bitset_malloc(sizeof(bitset_operation_words_t **) * (count + 1));
+    if (!decoded) {
+        bitset_oom();
+    }
+    size_t operands = 0;
+    for (size_t i = 0; i < count; i++) {
+        bitset_operation_flatten(operations[i]);
+        decoded[i] = bitset_calloc(1, sizeof(bitset_operation_words_t *) * (operations[i]->length + 1));
+        if (!decoded[i]) {
+            bitset_oom();
+        }
+        operands += operations[i]->length;
+    }
+
+    //Group steps which reference the same buffer
+    bitset_operation_operand_t *refs = bitset_malloc(sizeof(bitset_operation_operand_t) * (operands + 1));
+    if (!refs) {
+        bitset_oom();
+    }
+    for (size_t i = 0, k = 0; i < count; i++) {
+        for (size_t j = 0; j < operations[i]->length; j++, k++) {
+            refs[k].bitset = &operations[i]->steps[j]->data.bitset;
+            refs[k].decoded = &decoded[i][j];
+        }
+    }
+    qsort(refs, operands, sizeof(bitset_operation_operand_t), bitset_operation_operand_sort);
+
+    //Decode each operand that appears more than once
+    *shared = bitset_malloc(sizeof(bitset_operation_words_t *) * (operands + 1));
+    if (!*shared) {
+        bitset_oom();
+    }
+    *shared_length = 0;
+    for (size_t i = 0, j; i < operands; i = j) {
+        for (j = i + 1; j < operands && !bitset_operation_operand_sort(&refs[i], &refs[j]); j++);
+        if (j - i < 2 || !refs[i].bitset->length) {
+            continue;
+        }
+        bitset_operation_words_t *words = bitset_operation_words_new(refs[i].bitset);
+        (*shared)[(*shared_length)++] = words;
+        for (size_t k = i; k < j; k++) {
+            *refs[k].decoded = words;
+        }
+    }
+    bitset_malloc_free(refs);
+    return decoded;
+}
+
+static void bitset_operation_batch_free(bitset_operation_words_t ***decoded, size_t count,
+        bitset_operation_words_t **shared, size_t shared_length) {
+    for (size_t i = 0; i < shared_length; i++) {
+        bitset_operation_words_free(shared[i]);
+    }
+    bitset_malloc_free(shared);
+    for (size_t i = 0; i < count; i++) {
+        bitset_malloc_free(decoded[i]);
+    }
+    bitset_malloc_free(decoded);
+}
+
+void bitset_operation_exec_batch(bitset_operation_t **operations, size_t count, bitset_t **results) {
+    bitset_operation_words_t **shared;
+    size_t shared_length;
+    bitset_operation_words_t ***decoded = bitset_operation_batch_decode(operations, count,
+        &shared, &shared_length);
+    for (size_t i = 0; i < count; i++) {
+        results[i] = bitset_new();
+        bitset_operation_exec_decoded(operations[i], decoded[i], results[i]);
+        bitset_shrink(results[i]);
+    }
+    bitset_operation_batch_free(decoded, count, shared, shared_length);
+}
+
+void bitset_operation_count_batch(bitset_operation_t **operations, size_t count, bitset_offset *results) {
+    bitset_operation_words_t **shared;
+    size_t shared_length;
+    bitset_operation_words_t ***decoded = bitset_operation_batch_decode(operations, count,
+        &shared, &shared_length);
+    for (size_t i = 0; i < count; i++) {
+        results[i] = bitset_operation_count_decoded(operations[i], decoded[i]);
+    }
+    bitset_operation_batch_free(decoded, count, shared, shared_length);
+}
+
+/**
+ * Operations can also be evaluated by merging the operands in word offset
+ * order. Words are produced in ascending order which lets callers stop as
+ * soon as they have seen enough of the result.
+ */
+
+typedef struct bitset_operation_stream_s {
+    bitset_operation_t *operation;
+    bitset_cursor_t *cursors;
+    bool *active;
+    size_t first;
+    bool reverse;
+} bitset_operation_stream_t;
+
+static inline bool bitset_operation_stream_advance(bitset_operation_stream_t *stream, size_t i) {
+    if (stream->reverse) {
+        return bitset_cursor_prev(&stream->cursors[i]);
+    }
+    return bitset_cursor_next(&stream->cursors[i]);
+}
+
+static inline void bitset_operation_stream_init(bitset_operation_stream_t *stream,
+        bitset_operation_t *operation, bool reverse) {
+    bitset_operation_flatten(operation);
+    stream->operation = operation;
+    stream->first = 0;
+    stream->reverse = reverse;
+    stream->cursors = bitset_malloc(sizeof(bitset_cursor_t) * (operation->length + 1));
+    stream->active = bitset_malloc(sizeof(bool) * (operation->length + 1));
+    if (!stream->cursors || !stream->active) {
+        bitset_oom();
+    }
+    for (size_t i = 0; i < operation->length; i++) {
+        if (reverse) {
+            bitset_cursor_init_reverse(&stream->cursors[i], operation->steps[i]->data.bitset.buffer,
+                operation->steps[i]->data.bitset.length);
+        } else {
+            bitset_operation_cursor_init(&stream->cursors[i], &operation->steps[i]->data.bitset, NULL);
+        }
+        stream->active[i] = bitset_operation_stream_advance(stream, i);
+    }
+}
+
+static inline void bitset_operation_stream_seek(bitset_operation_stream_t *stream, bitset_offset offset) {
+    bitset_cursor_t *cursor;
+    for (size_t i = 0; i < stream->operation->length; i++) {
+        cursor = &stream->cursors[i];
+        while (stream->active[i] && (stream->reverse ? cursor->offset > offset : cursor->offset < offset)) {
+            stream->active[i] = bitset_operation_stream_advance(stream, i);
+        }
+    }
+}
+
+static inline void bitset_operation_stream_free(bitset_operation_stream_t *stream) {
+    bitset_malloc_free(stream->cursors);
+    bitset_malloc_free(stream->active);
+}
+
+static inline bool bitset_operation_stream_next(bitset_operation_stream_t *stream,
+        bitset_offset *offset, bitset_word *word) {
+    bitset_operation_t *operation = stream->operation;
+    bitset_offset min;
+    bitset_word result, step_word;
+    bool found, present;
+    for (;;) {
+        //Once an AND operand is exhausted the steps before it can't
+        //contribute to the result
+        for (size_t i = stream->first + 1; i < operation->length; i++) {
+            if (!stream->active[i] && operation->steps[i]->type == BITSET_AND) {
+                stream->first = i;
+            }
+        }
+        found = false;
+        min = 0;
+        for (size_t i = stream->first; i < operation->length; i++) {
+            if (stream->active[i] && (!found || (stream->reverse
+                    ? stream->cursors[i].offset > min : stream->cursors[i].offset < min))) {
+                min = stream->cursors[i].offset;
+                found = true;
+            }
+        }
+        if (!found) {
+            return false;
+        }
+        result = 0;
+        for (size_t i = stream->first; i < operation->length; i++) {
+            present = stream->active[i] && stream->cursors[i].offset == min;
+            step_word = present ? stream->cursors[i].word : 0;
+            if (present) {
+                stream->active[i] = bitset_operation_stream_advance(stream, i);
+            }
+            if (i == stream->first) {
+                result = step_word;
+                continue;
+            }
+            switch (operation->steps[i]->type) {
+                case BITSET_AND:    result &= step_word;  break;
+                case BITSET_OR:     result |= step_word;  break;
+                case BITSET_ANDNOT: result &= ~step_word; break;
+                case BITSET_XOR:    result ^= step_word;  break;
+            }
+        }
+        if (result) {
+            *offset = min;
+            *word = result;
+            return true;
+        }
+    }
+}
+
+bool bitset_operation_count_at_least(bitset_operation_t *operation, bitset_offset count) {
+    bitset_operation_stream_t stream;
+    bitset_offset offset, total = 0;
+    bitset_word word;
+    bool result = !count;
+    if (result || !operation->length) {
+        return result;
+    }
+    bitset_operation_stream_init(&stream, operation, false);
+    while (bitset_operation_stream_next(&stream, &offset, &word)) {
+        BITSET_POP_COUNT(total, word);
+        if (total >= count) {
+            result = true;
+            break;
+        }
+    }
+    bitset_operation_stream_free(&stream);
+    return result;
+}
+
+static bitset_iterator_t *bitset_operation_exec_range_stream(bitset_operation_t *operation,
+        bitset_offset start, size_t limit, bool reverse) {
+    bitset_iterator_t *iterator = bitset_malloc(sizeof(bitset_iterator_t));
+    if (!iterator) {
+        bitset_oom();
+    }
+    iterator->length = 0;
+    iterator->offsets = NULL;
+    if (!limit || !operation->length) {
+        return iterator;
+    }
+    size_t size = limit < 64 ? limit : 64;
+    iterator->offsets = bitset_malloc(sizeof(bitset_offset) * size);
+    if (!iterator->offsets) {
+        bitset_oom();
+    }
+    bitset_operation_stream_t stream;
+    bitset_offset offset, bit;
+    bitset_word word;
+    bitset_operation_stream_init(&stream, operation, reverse);
+    bitset_operation_stream_seek(&stream, start / BITSET_LITERAL_LENGTH + 1);
+    while (iterator->length < limit && bitset_operation_stream_next(&stream, &offset, &word)) {
+        for (size_t i = 0; i < BITSET_LITERAL_LENGTH && iterator->length < limit; i++) {
+            size_t x = reverse ? i : BITSET_LITERAL_LENGTH - i - 1;
+            if (!(word & (1 << x))) {
+                continue;
+            }
+            bit = (offset - 1) * BITSET_LITERAL_LENGTH + BITSET_LITERAL_LENGTH - x - 1;
+            if (reverse ? bit > start : bit < start) {
+                continue;
+            }
+            if (iterator->length == size) {
+                size = size * 2 < limit ? size * 2 : limit;
+                iterator->offsets = bitset_realloc(iterator->offsets, sizeof(bitset_offset) * size);
+                if (!iterator->offsets) {
+                    bitset_oom();
+                }
+            }
+            iterator->offsets[iterator->length++] = bit;
+        }
+    }
+    bitset_operation_stream_free(&stream);
+    if (!iterator->length) {
+        bitset_malloc_free(iterator->offsets);
+        iterator->offsets = NULL;
+    }
+    return iterator;
+}
+
+bitset_iterator_t *bitset_operation_exec_range(bitset_operation_t *operation,
+        bitset_offset start, size_t limit) {
+    return bitset_operation_exec_range_stream(operation, start, limit, false);
+}
+
+bitset_iterator_t *bitset_operation_exec_range_desc(bitset_operation_t *operation,
+        bitset_offset start, size_t limit) {
+    return bitset_operation_exec_range_stream(operation, start, limit, true);
+}
@@ -6,6 +6,11 @@
 
 #include "bitset/malloc.h"
 #include "bitset/vector.h"
+#include "cursor.h"
+
+#ifdef HAVE_PTHREAD_H
+#  include <pthread.h>
+#endif
 
 bitset_vector_t *bitset_vector_new() {
     bitset_vector_t *vector = bitset_malloc(sizeof(bitset_vector_t));
@@ -17,18 +22,139 @@ bitset_vector_t *bitset_vector_new() {
         bitset_oom();
     }
     vector->tail_offset = 0;
+    vector->base_offset = 0;
     vector->size = 1;
     vector->length = 0;
+    vector->count = 0;
+    vector->directory = NULL;
+    vector->popcounts = NULL;
+    vector->popcounts_size = 0;
     return vector;
 }
 
+static inline void bitset_vector_directory_free(bitset_vector_directory_t *directory) {
+    bitset_malloc_free(directory->offsets);
+    bitset_malloc_free(directory->positions);
+    bitset_malloc_free(directory);
+}
+
 void bitset_vector_free(bitset_vector_t *vector) {
-    bitset_malloc_free(vector->buffer);
+    if (vector->directory) {
+        bitset_vector_directory_free(vector->directory);
+    }
+    if (vector->size) {
+        bitset_malloc_free(vector->buffer);
+    }
+    if (vector->popcounts_size) {
+        bitset_malloc_free(vector->popcounts);
+    }
     bitset_malloc_free(vector);
 }
 
+static inline bitset_vector_directory_t *bitset_vector_directory_new(unsigned interval, size_t size) {
+    bitset_vector_directory_t *directory = bitset_malloc(sizeof(bitset_vector_directory_t));
+    if (!directory) {
+        bitset_oom();
+    }
+    directory->interval = interval ? interval : 1;
+    directory->length = 0;
+    directory->size = size ? size : 1;
+    directory->offsets = bitset_malloc(sizeof(unsigned) * directory->size);
+    directory->positions = bitset_malloc(sizeof(size_t) * directory->size);
+    if (!directory->offsets || !directory->positions) {
+        bitset_oom();
+    }
+    return directory;
+}
+
+static inline void bitset_vector_directory_add(bitset_vector_t *vector, unsigned offset, size_t position) {
+    bitset_vector_directory_t *directory = vector->directory;
+    if (!directory || vector->count % directory->interval) {
+        return;
+    }
+    if (directory->length == directory->size) {
+        directory->size *= 2;
+        directory->offsets = bitset_realloc(directory->offsets, sizeof(unsigned) * directory->size);
+        directory->positions = bitset_realloc(directory->positions, sizeof(size_t) * directory->size);
+        if (!directory->offsets || !directory->positions) {
+            bitset_oom();
+        }
+    }
+    directory->offsets[directory->length] = offset;
+    directory->positions[directory->length++] = position;
+}
+
+static inline unsigned bitset_vector_popcount64(uint64_t word) {
+#if defined(__GNUC__)
+    return __builtin_popcountll(word);
+#else
+    word -= (word >> 1) & 0x5555555555555555ULL;
+    word = (word & 0x3333333333333333ULL) + ((word >> 2) & 0x3333333333333333ULL);
+    word = (word + (word >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+    return (word * 0x0101010101010101ULL) >> 56;
+#endif
+}
+
+static inline bitset_offset bitset_vector_popcount(const bitset_t *bitset) {
+    const bitset_word *words = bitset->buffer;
+    size_t i = 0, length = bitset->length;
+    bitset_offset count = 0;
+    while (i < length) {
+        //Count runs of literal words two at a time
+        if (i + 1 < length && !BITSET_IS_FILL_WORD(words[i]) && !BITSET_IS_FILL_WORD(words[i + 1])) {
+            count += bitset_vector_popcount64((uint64_t) words[i] | ((uint64_t) words[i + 1] << 32));
+            i += 2;
+        } else if (BITSET_IS_FILL_WORD(words[i])) {
+            count += BITSET_GET_POSITION(words[i++]) ? 1 : 0;
+        } else {
+            count += bitset_vector_popcount64(words[i++]);
+        }
+    }
+    return count;
+}
+
+static inline void bitset_vector_popcounts_reserve(bitset_vector_t *vector, size_t count) {
+    size_t size = vector->popcounts_size ? vector->popcounts_size : 16;
+    if (count <= vector->popcounts_size) {
+        return;
+    }
+    while (size < count) {
+        size *= 2;
+    }
+    vector->popcounts = bitset_realloc(vector->popcounts, sizeof(bitset_offset) * size);
+    if (!vector->popcounts) {
+        bitset_oom();
+    }
+    vector->popcounts_size = size;
+}
+
+static inline void bitset_vector_popcounts_add(bitset_vector_t *vector, const bitset_t *bitset) {
+    if (vector->popcounts) {
+        bitset_vector_popcounts_reserve(vector, vector->count + 1);
+        vector->popcounts[vector->count] = bitset_vector_popcount(bitset);
+    }
+}
+
+static inline void bitset_vector_popcounts_fill(bitset_vector_t *vector) {
+    unsigned offset;
+    size_t index = 0;
+    bitset_t *bitset;
+    bitset_vector_popcounts_reserve(vector, vector->count ? vector->count : 1);
+    BITSET_VECTOR_FOREACH(vector, bitset, offset) {
+        vector->popcounts[index++] = bitset_vector_popcount(bitset);
+    }
+}
+
 bitset_vector_t *bitset_vector_copy(const bitset_vector_t *vector) {
     bitset_vector_t *copy = bitset_vector_new();
+    if (vector->popcounts) {
+        bitset_vector_popcounts_reserve(copy, vector->count ? vector->count : 1);
+        memcpy(copy->popcounts, vector->popcounts, sizeof(bitset_offset) * vector->count);
+    }
+    if (vector->base_offset) {
+        bitset_vector_concat(copy, vector, 0, BITSET_VECTOR_START, BITSET_VECTOR_END);
+        return copy;
+    }
     if (vector->length) {
         copy->buffer = bitset_realloc(copy->buffer, sizeof(char) * vector->length);
         if (!copy->buffer) {
@@ -37,11 +163,22 @@ bitset_vector_t *bitset_vector_copy(const bitset_vector_t *vector) {
         memcpy(copy->buffer, vector->buffer, vector->length);
         copy->length = copy->size = vector->length;
         copy->tail_offset = vector->tail_offset;
+        copy->count = vector->count;
+    }
+    if (vector->directory) {
+        bitset_vector_directory_t *directory = vector->directory;
+        copy->directory = bitset_vector_directory_new(directory->interval, directory->length);
+        memcpy(copy->directory->offsets, directory->offsets, sizeof(unsigned) * directory->length);
+        memcpy(copy->directory->positions, directory->positions, sizeof(size_t) * directory->length);
+        copy->directory->length = directory->length;
     }
     return copy;
 }
 
 void bitset_vector_resize(bitset_vector_t *vector, size_t length) {
+    if (!vector->size) {
+        BITSET_FATAL("vector views are read-only");
+    }
     size_t new_size = vector->size;
     while (new_size < length) {
         new_size *= 2;
@@ -56,26 +193,83 @@ void bitset_vector_resize(bitset_vector_t *vector, size_t length) {
     vector->length = length;
 }
 
-char *bitset_vector_export(const bitset_vector_t *vector) {
-    return vector->buffer;
+static void bitset_vector_index(bitset_vector_t *vector) {
+    char *buffer = vector->buffer, *next;
+    bitset_t bitset;
+    vector->tail_offset = vector->base_offset;
+    vector->count = 0;
+    if (vector->directory) {
+        vector->directory->length = 0;
+    }
+    while (buffer < vector->buffer + vector->length) {
+        next = bitset_vector_advance(buffer, &bitset, &vector->tail_offset);
+        bitset_vector_directory_add(vector, vector->tail_offset, buffer - vector->buffer);
+        vector->count++;
+        buffer = next;
+    }
 }
 
-size_t bitset_vector_length(const bitset_vector_t *vector) {
-    return vector->length;
+void bitset_vector_init(bitset_vector_t *vector) {
+    bitset_vector_index(vector);
+    if (vector->popcounts) {
+        bitset_vector_popcounts_fill(vector);
+    }
 }
 
-void bitset_vector_init(bitset_vector_t *vector) {
-    char *buffer = vector->buffer;
-    bitset_t bitset;
-    vector->tail_offset = 0;
-    while (buffer < vector->buffer + vector->length) {
-        buffer = bitset_vector_advance(buffer, &bitset, &vector->tail_offset);
+void bitset_vector_build_directory(bitset_vector_t *vector, unsigned interval) {
+    if (vector->directory) {
+        bitset_vector_directory_free(vector->directory);
+    }
+    vector->directory = bitset_vector_directory_new(interval, 16);
+    bitset_vector_index(vector);
+}
+
+void bitset_vector_store_counts(bitset_vector_t *vector) {
+    if (!vector->size) {
+        BITSET_FATAL("vector views are read-only");
+    }
+    if (!vector->popcounts) {
+        bitset_vector_popcounts_fill(vector);
+    }
+}
+
+static inline void bitset_vector_trailer_write(char *buffer, uint64_t value, unsigned bytes) {
+    for (unsigned i = 0; i < bytes; i++) {
+        buffer[i] = (unsigned char)(value >> ((bytes - i - 1) * 8));
+    }
+}
+
+static inline uint64_t bitset_vector_trailer_read(const char *buffer, unsigned bytes) {
+    uint64_t value = 0;
+    for (unsigned i = 0; i < bytes; i++) {
+        value = (value << 8) | (unsigned char)buffer[i];
     }
+    return value;
 }
 
 bitset_vector_t *bitset_vector_import(const char *buffer, size_t length) {
     bitset_vector_t *vector = bitset_vector_new();
-    if (length) {
+    bitset_vector_trailer_t trailer;
+    bool has_trailer = buffer && bitset_vector_read_trailer(buffer, length, &trailer);
+    if (has_trailer && trailer.version > BITSET_VECTOR_TRAILER_VERSION) {
+        //Scan the buffer rather than trust a trailer we don't understand
+        has_trailer = false;
+        length = trailer.length;
+    }
+    if (has_trailer) {
+        if (trailer.length) {
+            bitset_vector_resize(vector, trailer.length);
+            memcpy(vector->buffer, buffer, trailer.length);
+        }
+        vector->tail_offset = trailer.tail_offset;
+        vector->count = trailer.count;
+        if (trailer.flags & BITSET_VECTOR_TRAILER_COUNTS) {
+            bitset_vector_popcounts_reserve(vector, trailer.count ? trailer.count : 1);
+            for (unsigned i = 0; i < trailer.count; i++) {
+                vector->popcounts[i] = bitset_vector_trailer_read(buffer + trailer.length + i * 8, 8);
+            }
+        }
+    } else if (length) {
         bitset_vector_resize(vector, length);
         if (buffer) {
             memcpy(vector->buffer, buffer, length);
@@ -125,25 +319,107 @@ char *bitset_vector_advance(char *buffer, bitset_t *bitset, unsigned *offset) {
     bitset->length = bitset_encoded_length(buffer);
     buffer += bitset_encoded_length_size(buffer);
     bitset->buffer = (bitset_word *) buffer;
+    bitset->size = 0;
+    bitset->version = 0;
     return buffer + bitset->length * sizeof(bitset_word);
 }
 
-static inline char *bitset_vector_encode(bitset_vector_t *vector, const bitset_t *bitset, unsigned offset) {
-    size_t length_bytes = bitset_encoded_length_required_bytes(bitset->length);
-    size_t offset_bytes = bitset_encoded_length_required_bytes(offset);
-    size_t current_length = vector->length;
-    bitset_vector_resize(vector, vector->length + length_bytes + offset_bytes + bitset->length * sizeof(bitset_word));
-    char *buffer = vector->buffer + current_length;
+static inline char *bitset_vector_seek(const bitset_vector_t *vector, unsigned offset,
+        unsigned *previous, unsigned *index) {
+    const bitset_vector_directory_t *directory = vector->directory;
+    char *buffer = vector->buffer, *next, *end = vector->buffer + vector->length;
+    unsigned current = vector->base_offset, last;
+    bitset_t bitset;
+    *index = 0;
+    if (directory && directory->length && directory->offsets[0] <= offset) {
+        size_t low = 0, high = directory->length, mid;
+        while (high - low > 1) {
+            mid = low + (high - low) / 2;
+            if (directory->offsets[mid] <= offset) {
+                low = mid;
+            } else {
+                high = mid;
+            }
+        }
+        buffer = vector->buffer + directory->positions[low];
+        current = directory->offsets[low] - bitset_encoded_length(buffer);
+        *index = low * directory->interval;
+    }
+    for (; buffer < end; buffer = next, (*index)++) {
+        last = current;
+        next = bitset_vector_advance(buffer, &bitset, &current);
+        if (current >= offset) {
+            *previous = last;
+            return buffer;
+        }
+    }
+    *previous = current;
+    return end;
+}
+
+bool bitset_vector_get(const bitset_vector_t *vector, unsigned offset, bitset_t *bitset) {
+    unsigned current, index;
+    char *buffer = bitset_vector_seek(vector, offset, &current, &index);
+    if (buffer == vector->buffer + vector->length) {
+        return false;
+    }
+    bitset_vector_advance(buffer, bitset, &current);
+    return current == offset;
+}
+
+void bitset_vector_rebase(bitset_vector_t *vector) {
+    bitset_vector_t *copy, tmp;
+    unsigned interval = vector->directory ? vector->directory->interval : 0;
+    if (!vector->base_offset && vector->size) {
+        return;
+    }
+    copy = bitset_vector_copy(vector);
+    tmp = *vector;
+    *vector = *copy;
+    *copy = tmp;
+    bitset_vector_free(copy);
+    if (interval) {
+        bitset_vector_build_directory(vector, interval);
+    }
+}
+
+char *bitset_vector_export(const bitset_vector_t *vector) {
+    if (vector->base_offset && vector->length) {
+        BITSET_FATAL("vector views must be rebased before they're exported");
+    }
+    return vector->buffer;
+}
+
+size_t bitset_vector_length(const bitset_vector_t *vector) {
+    return vector->length;
+}
+
+static inline size_t bitset_vector_entry_length(const bitset_t *bitset, unsigned offset) {
+    return bitset_encoded_length_required_bytes(offset) +
+        bitset_encoded_length_required_bytes(bitset->length) + bitset->length * sizeof(bitset_word);
+}
+
+static inline char *bitset_vector_write(char *buffer, const bitset_t *bitset, unsigned offset) {
     bitset_encoded_length_bytes(buffer, offset);
-    buffer += offset_bytes;
+    buffer += bitset_encoded_length_required_bytes(offset);
     bitset_encoded_length_bytes(buffer, bitset->length);
-    buffer += length_bytes;
+    buffer += bitset_encoded_length_required_bytes(bitset->length);
     if (bitset->length) {
         memcpy(buffer, bitset->buffer, bitset->length * sizeof(bitset_word));
     }
     return buffer + bitset->length * sizeof(bitset_word);
 }
 
+static inline char *bitset_vector_encode(bitset_vector_t *vector, const bitset_t *bitset, unsigned offset) {
+    size_t current_length = vector->length;
+    bitset_vector_resize(vector, vector->length + bitset_vector_entry_length(bitset, offset));
+    bitset_vector_directory_add(vector, vector->tail_offset + offset, current_length);
+    bitset_vector_popcounts_add(vector, bitset);
+    vector->tail_offset += offset;
+    vector->count++;
+    return bitset_vector_write(vector->buffer + current_length, bitset, offset);
+}
+
 void bitset_vector_push(bitset_vector_t *vector, const bitset_t *bitset, unsigned offset) {
     if (vector->length && vector->tail_offset >= offset) {
         BITSET_FATAL("bitset vectors are append-only");
@@ -152,388 +428,2069 @@ void bitset_vector_push(bitset_vector_t *vector, const bitset_t *bitset, unsigne
     vector->tail_offset = offset;
 }
 
-void bitset_vector_concat(bitset_vector_t *vector, const bitset_vector_t *next, unsigned offset, unsigned start, unsigned end) {
-    if (vector->length && vector->tail_offset >= offset) {
-        BITSET_FATAL("bitset vectors are append-only");
+static inline char *bitset_vector_splice(bitset_vector_t *vector, size_t position,
+        size_t remove, size_t insert) {
+    size_t length = vector->length;
+    if (insert > remove) {
+        bitset_vector_resize(vector, length + insert - remove);
+    } else {
+        vector->length = length + insert - remove;
     }
+    memmove(vector->buffer + position + insert, vector->buffer + position + remove,
+        length - position - remove);
+    return vector->buffer + position;
+}
 
-    unsigned current_offset = 0;
-    bitset_t bitset;
+static bool bitset_vector_set_to(bitset_vector_t *vector, unsigned offset, bitset_offset bit, bool value) {
+    unsigned previous, current, following, index;
+    char *entry, *next, *end;
+    size_t position, remove, insert;
+    bitset_t bitset, *edited;
+    if (!vector->size) {
+        BITSET_FATAL("vector views are read-only");
+    }
+    if (offset < vector->base_offset) {
+        BITSET_FATAL("offset is before the start of the vector");
+    }
 
-    char *buffer, *c_buffer = next->buffer, *c_start, *c_end = next->buffer + next->length;
-    while (c_buffer < c_end) {
-        c_buffer = bitset_vector_advance(c_buffer, &bitset, &current_offset);
-        if (current_offset >= start && (!end || current_offset < end)) {
-            c_start = c_buffer;
-
-            //Copy the initial bitset from c
-            buffer = bitset_vector_encode(vector, &bitset, offset + current_offset - vector->tail_offset);
-
-            //Look for a slice end point
-            if (end != BITSET_VECTOR_END && c_end > c_start) {
-                do {
-                    c_end = c_buffer;
-                    if (c_end == next->buffer + next->length) {
-                        break;
-                    }
-                    c_buffer = bitset_vector_advance(c_buffer, &bitset, &current_offset);
-                    vector->tail_offset = current_offset + offset;
-                } while (current_offset < end);
-            } else {
-                vector->tail_offset = next->tail_offset + offset;
-            }
+    //Bits after the tail are appended
+    if (!vector->length || offset > vector->tail_offset) {
+        if (value) {
+            edited = bitset_new();
+            bitset_set(edited, bit);
+            bitset_vector_push(vector, edited, offset);
+            bitset_free(edited);
+        }
+        return false;
+    }
 
-            //Concat the rest of the vector
-            if (c_end > c_start) {
-                uintptr_t buf_offset = buffer - vector->buffer;
-                bitset_vector_resize(vector, vector->length + (c_end - c_start));
-                memcpy(vector->buffer + buf_offset, c_start, c_end - c_start);
-            }
+    entry = bitset_vector_seek(vector, offset, &previous, &index);
+    end = vector->buffer + vector->length;
+    position = entry - vector->buffer;
+    current = previous;
+    next = bitset_vector_advance(entry, &bitset, &current);
 
-            break;
+    if (current != offset) {
+        if (!value) {
+            return false;
+        }
+        //Insert a new entry and shorten the delta of the entry that follows
+        edited = bitset_new();
+        bitset_set(edited, bit);
+        remove = bitset_encoded_length_size(entry);
+        insert = bitset_vector_entry_length(edited, offset - previous) +
+            bitset_encoded_length_required_bytes(current - offset);
+        entry = bitset_vector_splice(vector, position, remove, insert);
+        entry = bitset_vector_write(entry, edited, offset - previous);
+        bitset_encoded_length_bytes(entry, current - offset);
+        bitset_free(edited);
+        if (vector->popcounts) {
+            bitset_vector_popcounts_reserve(vector, vector->count + 1);
+            memmove(vector->popcounts + index + 1, vector->popcounts + index,
+                sizeof(bitset_offset) * (vector->count - index));
+            vector->popcounts[index] = 1;
+        }
+        vector->count++;
+    } else {
+        if (bitset_get(&bitset, bit) == value) {
+            return value;
+        }
+        edited = bitset_copy(&bitset);
+        bitset_set_to(edited, bit, value);
+        remove = next - entry;
+        if (vector->popcounts) {
+            vector->popcounts[index] += value ? 1 : -1;
+        }
+        if (bitset_count(edited)) {
+            //Rewrite the entry, shifting the bytes that follow when its length changes
+            insert = bitset_vector_entry_length(edited, offset - previous);
+            entry = bitset_vector_splice(vector, position, remove, insert);
+            bitset_vector_write(entry, edited, offset - previous);
+            if (insert != remove && vector->directory) {
+                for (size_t i = 0; i < vector->directory->length; i++) {
+                    if (vector->directory->positions[i] > position) {
+                        vector->directory->positions[i] += insert - remove;
+                    }
+                }
+            }
+            bitset_free(edited);
+            return !value;
+        }
+        //Remove the emptied entry and extend the delta of the entry that follows
+        bitset_free(edited);
+        if (next < end) {
+            following = current;
+            bitset_vector_advance(next, &bitset, &following);
+            remove += bitset_encoded_length_size(next);
+            insert = bitset_encoded_length_required_bytes(following - previous);
+            entry = bitset_vector_splice(vector, position, remove, insert);
+            bitset_encoded_length_bytes(entry, following - previous);
+        } else {
+            bitset_vector_splice(vector, position, remove, 0);
+            vector->tail_offset = previous;
+        }
+        if (vector->popcounts) {
+            memmove(vector->popcounts + index, vector->popcounts + index + 1,
+                sizeof(bitset_offset) * (vector->count - index - 1));
+        }
+        vector->count--;
+        if (!vector->length) {
+            vector->tail_offset = vector->base_offset;
         }
     }
-}
 
-unsigned bitset_vector_bitsets(const bitset_vector_t *vector) {
-    unsigned count = 0, offset;
-    bitset_t *bitset;
-    BITSET_VECTOR_FOREACH(vector, bitset, offset) {
-        count++;
+    //Entries were added or removed so the directory samples are out of step
+    if (vector->directory) {
+        bitset_vector_build_directory(vector, vector->directory->interval);
     }
-    return count;
+    return !value;
 }
 
-void bitset_vector_cardinality(const bitset_vector_t *vector, unsigned *raw, unsigned *unique) {
-    unsigned offset;
-    bitset_t *bitset;
-    *raw = 0;
-    BITSET_VECTOR_FOREACH(vector, bitset, offset) {
-        *raw += bitset_count(bitset);
+bool bitset_vector_set(bitset_vector_t *vector, unsigned offset, bitset_offset bit) {
+    return bitset_vector_set_to(vector, offset, bit, true);
+}
+
+bool bitset_vector_unset(bitset_vector_t *vector, unsigned offset, bitset_offset bit) {
+    return bitset_vector_set_to(vector, offset, bit, false);
+}
+
+static void bitset_vector_concat_slice(bitset_vector_t *vector, const bitset_vector_t *next,
+        unsigned offset, unsigned start, unsigned end) {
+    unsigned current_offset, tail_offset, index, copied = 0;
+    bitset_t bitset;
+    size_t position;
+
+    //Find the first bitset in the slice
+    char *c_buffer, *c_start, *c_end = next->buffer + next->length;
+    c_buffer = bitset_vector_seek(next, start, &current_offset, &index);
+    if (c_buffer == c_end) {
+        return;
     }
-    if (unique) {
-        if (*raw) {
-            bitset_linear_t *counter = bitset_linear_new(*raw * 100);
-            BITSET_VECTOR_FOREACH(vector, bitset, offset) {
-                bitset_linear_add(counter, bitset);
+    c_start = bitset_vector_advance(c_buffer, &bitset, &current_offset);
+    if (end != BITSET_VECTOR_END && current_offset >= end) {
+        return;
+    }
+
+    //Copy the initial bitset from next
+    bitset_vector_encode(vector, &bitset, offset + current_offset - vector->tail_offset);
+
+    //Look for a slice end point
+    if (end != BITSET_VECTOR_END) {
+        tail_offset = current_offset;
+        for (c_buffer = c_start; c_buffer < c_end; copied++) {
+            char *c_next = bitset_vector_advance(c_buffer, &bitset, &current_offset);
+            if (current_offset >= end) {
+                break;
             }
-            *unique = bitset_linear_count(counter);
-            bitset_linear_free(counter);
-        } else {
-            *unique = 0;
+            tail_offset = current_offset;
+            c_buffer = c_next;
         }
+        c_end = c_buffer;
+    } else {
+        tail_offset = next->tail_offset;
+        copied = next->count - index - 1;
     }
-}
 
-bitset_t *bitset_vector_merge(const bitset_vector_t *vector) {
-    unsigned offset;
-    bitset_t *bitset;
-    bitset_operation_t *operation = bitset_operation_new(NULL);
-    BITSET_VECTOR_FOREACH(vector, bitset, offset) {
-        bitset_operation_add(operation, bitset, BITSET_OR);
+    //Concat the rest of the vector
+    if (c_end > c_start) {
+        position = vector->length;
+        bitset_vector_resize(vector, vector->length + (c_end - c_start));
+        memcpy(vector->buffer + position, c_start, c_end - c_start);
+        if (vector->popcounts) {
+            bitset_vector_popcounts_reserve(vector, vector->count + copied);
+            if (next->popcounts) {
+                memcpy(vector->popcounts + vector->count, next->popcounts + index + 1,
+                    sizeof(bitset_offset) * copied);
+            } else {
+                bitset_offset *popcount = vector->popcounts + vector->count;
+                for (char *buffer = vector->buffer + position; buffer < vector->buffer + vector->length; ) {
+                    buffer = bitset_vector_advance(buffer, &bitset, &current_offset);
+                    *popcount++ = bitset_vector_popcount(&bitset);
+                }
+            }
+        }
+        if (vector->directory) {
+            current_offset = vector->tail_offset;
+            for (char *buffer = vector->buffer + position; buffer < vector->buffer + vector->length; ) {
+                char *next_buffer = bitset_vector_advance(buffer, &bitset, &current_offset);
+                bitset_vector_directory_add(vector, current_offset, buffer - vector->buffer);
+                vector->count++;
+                buffer = next_buffer;
+            }
+        } else {
+            vector->count += copied;
+        }
     }
-    bitset = bitset_operation_exec(operation);
-    bitset_operation_free(operation);
-    return bitset;
+    vector->tail_offset = tail_offset + offset;
 }
 
-static inline void bitset_vector_start_end(bitset_vector_t *vector, unsigned *start, unsigned *end) {
-    if (!vector->length) {
-        *start = 0;
-        *end = 0;
-        return;
+void bitset_vector_concat(bitset_vector_t *vector, const bitset_vector_t *next, unsigned offset, unsigned start, unsigned end) {
+    if (vector->length && vector->tail_offset >= offset) {
+        BITSET_FATAL("bitset vectors are append-only");
     }
-    bitset_t bitset;
-    bitset_vector_advance(vector->buffer, &bitset, start);
-    *end = vector->tail_offset;
+    bitset_vector_concat_slice(vector, next, offset, start, end);
 }
 
-bitset_vector_operation_t *bitset_vector_operation_new(bitset_vector_t *vector) {
-    bitset_vector_operation_t *operation = bitset_malloc(sizeof(bitset_vector_operation_t));
-    if (!operation) {
+bitset_vector_t *bitset_vector_view(const bitset_vector_t *vector, unsigned start, unsigned end) {
+    bitset_vector_t *view = bitset_malloc(sizeof(bitset_vector_t));
+    if (!view) {
         bitset_oom();
     }
-    operation->length = operation->max = 0;
-    operation->min = UINT_MAX;
-    if (vector) {
-        bitset_vector_operation_add(operation, vector, BITSET_OR);
+    unsigned offset, index;
+    bitset_t bitset;
+    char *buffer, *next, *buffer_end = vector->buffer + vector->length;
+    buffer = bitset_vector_seek(vector, start, &view->base_offset, &index);
+    view->buffer = buffer;
+    view->size = 0;
+    view->directory = NULL;
+    view->popcounts = vector->popcounts ? vector->popcounts + index : NULL;
+    view->popcounts_size = 0;
+    if (end == BITSET_VECTOR_END) {
+        view->tail_offset = vector->tail_offset;
+        view->count = vector->count - index;
+        buffer = buffer_end;
+    } else {
+        view->tail_offset = offset = view->base_offset;
+        view->count = 0;
+        while (buffer < buffer_end) {
+            next = bitset_vector_advance(buffer, &bitset, &offset);
+            if (offset >= end) {
+                break;
+            }
+            view->tail_offset = offset;
+            view->count++;
+            buffer = next;
+        }
     }
-    return operation;
+    view->length = buffer - view->buffer;
+    if (!view->length) {
+        view->base_offset = view->tail_offset = 0;
+    }
+    return view;
 }
 
-void bitset_vector_operation_free(bitset_vector_operation_t *operation) {
-    if (operation->length) {
-        for (size_t i = 0; i < operation->length; i++) {
-            if (operation->steps[i]->is_nested) {
-                if (operation->steps[i]->is_operation) {
-                    bitset_vector_operation_free(operation->steps[i]->data.operation);
-                } else {
-                    bitset_vector_free(operation->steps[i]->data.vector);
-                }
-            }
-            bitset_malloc_free(operation->steps[i]);
+unsigned bitset_vector_bitsets(const bitset_vector_t *vector) {
+    return vector->count;
+}
+
+/**
+ * Word cursors from the same array are ordered by offset and then by their
+ * position in the array, so words at the same offset are popped in order.
+ */
+
+static inline bool bitset_vector_word_before(const bitset_cursor_t *a, const bitset_cursor_t *b) {
+    return a->offset < b->offset || (a->offset == b->offset && a < b);
+}
+
+static inline void bitset_vector_word_heap_push(bitset_cursor_t **heap, size_t *length,
+        bitset_cursor_t *cursor) {
+    size_t i = (*length)++, parent;
+    for (; i; i = parent) {
+        parent = (i - 1) / 2;
+        if (bitset_vector_word_before(heap[parent], cursor)) {
+            break;
         }
-        bitset_malloc_free(operation->steps);
+        heap[i] = heap[parent];
     }
-    bitset_malloc_free(operation);
+    heap[i] = cursor;
 }
 
-void bitset_vector_operation_free_operands(bitset_vector_operation_t *operation) {
-    if (operation->length) {
-        for (size_t i = 0; i < operation->length; i++) {
-            if (operation->steps[i]->is_nested) {
-                if (operation->steps[i]->is_operation) {
-                    bitset_vector_operation_free_operands(operation->steps[i]->data.operation);
-                }
-            } else {
-                if (operation->steps[i]->data.vector) {
-                    bitset_vector_free(operation->steps[i]->data.vector);
-                }
-                operation->steps[i]->data.vector = NULL;
-            }
+static inline bitset_cursor_t *bitset_vector_word_heap_pop(bitset_cursor_t **heap,
+        size_t *length) {
+    bitset_cursor_t *top = heap[0], *last = heap[--(*length)];
+    size_t i = 0, child;
+    while ((child = i * 2 + 1) < *length) {
+        if (child + 1 < *length && bitset_vector_word_before(heap[child + 1], heap[child])) {
+            child++;
+        }
+        if (!bitset_vector_word_before(heap[child], last)) {
+            break;
         }
+        heap[i] = heap[child];
+        i = child;
     }
+    heap[i] = last;
+    return top;
 }
 
-static inline bitset_vector_operation_step_t *
-        bitset_vector_operation_add_step(bitset_vector_operation_t *operation) {
-    bitset_vector_operation_step_t *step = bitset_malloc(sizeof(bitset_vector_operation_step_t));
-    if (!step) {
+static unsigned bitset_vector_unique_exact(const bitset_vector_t *vector) {
+    bitset_cursor_t *cursors, *cursor, **heap;
+    bitset_t *bitset;
+    size_t heap_length = 0, i = 0;
+    unsigned offset, unique = 0;
+    bitset_offset word_offset;
+    bitset_word word;
+    if (!vector->count) {
+        return 0;
+    }
+    cursors = bitset_malloc(sizeof(bitset_cursor_t) * vector->count);
+    heap = bitset_malloc(sizeof(bitset_cursor_t *) * vector->count);
+    if (!cursors || !heap) {
         bitset_oom();
     }
-    if (operation->length % 2 == 0) {
-        if (!operation->length) {
-            operation->steps = bitset_malloc(sizeof(bitset_vector_operation_step_t *) * 2);
-        } else {
-            operation->steps = bitset_realloc(operation->steps, sizeof(bitset_vector_operation_step_t *) * operation->length * 2);
+    BITSET_VECTOR_FOREACH(vector, bitset, offset) {
+        cursor = &cursors[i++];
+        bitset_cursor_init(cursor, bitset->buffer, bitset->length);
+        if (bitset_cursor_next(cursor)) {
+            bitset_vector_word_heap_push(heap, &heap_length, cursor);
         }
-        if (!operation->steps) {
+    }
+    while (heap_length) {
+        word_offset = heap[0]->offset;
+        word = 0;
+        while (heap_length && heap[0]->offset == word_offset) {
+            cursor = bitset_vector_word_heap_pop(heap, &heap_length);
+            word |= cursor->word;
+            if (bitset_cursor_next(cursor)) {
+                bitset_vector_word_heap_push(heap, &heap_length, cursor);
+            }
+        }
+        BITSET_POP_COUNT(unique, word);
+    }
+    bitset_malloc_free(cursors);
+    bitset_malloc_free(heap);
+    return unique;
+}
+
+/**
+ * A fold combines bitsets left to right like bitset_operation does, but
+ * merges their words in offset order through a heap of cursors so the result
+ * is encoded in a single pass. A bitset without a word at an offset
+ * contributes an empty word there.
+ */
+
+typedef struct bitset_vector_fold_s {
+    bitset_t *bitsets;
+    enum bitset_operation_type *types;
+    size_t *ands;
+    bitset_cursor_t *cursors;
+    bitset_cursor_t **heap;
+    size_t length;
+    size_t size;
+} bitset_vector_fold_t;
+
+static inline void bitset_vector_fold_add(bitset_vector_fold_t *fold, const bitset_t *bitset,
+        enum bitset_operation_type type) {
+    if (fold->length == fold->size) {
+        fold->size = fold->size ? fold->size * 2 : 16;
+        fold->bitsets = bitset_realloc(fold->bitsets, sizeof(bitset_t) * fold->size);
+        fold->types = bitset_realloc(fold->types, sizeof(enum bitset_operation_type) * fold->size);
+        fold->ands = bitset_realloc(fold->ands, sizeof(size_t) * fold->size);
+        fold->cursors = bitset_realloc(fold->cursors, sizeof(bitset_cursor_t) * fold->size);
+        fold->heap = bitset_realloc(fold->heap, sizeof(bitset_cursor_t *) * fold->size);
+        if (!fold->bitsets || !fold->types || !fold->ands || !fold->cursors || !fold->heap) {
             bitset_oom();
         }
     }
-    operation->steps[operation->length++] = step;
-    return step;
+    fold->types[fold->length] = type;
+    fold->bitsets[fold->length++] = *bitset;
 }
 
-void bitset_vector_operation_add(bitset_vector_operation_t *operation,
+static inline void bitset_vector_fold_free(bitset_vector_fold_t *fold) {
+    if (fold->size) {
+        bitset_malloc_free(fold->bitsets);
+        bitset_malloc_free(fold->types);
+        bitset_malloc_free(fold->ands);
+        bitset_malloc_free(fold->cursors);
+        bitset_malloc_free(fold->heap);
+    }
+}
+
+/**
+ * Fold the bitsets added since the last fold into result, or just count the
+ * bits of the result when it's NULL. The type of the first bitset is ignored.
+ */
+
+static bitset_offset bitset_vector_fold_exec(bitset_vector_fold_t *fold, bitset_t *result) {
+    bitset_cursor_t *cursors = fold->cursors, **heap = fold->heap, *cursor;
+    size_t length = fold->length, heap_length = 0, last_and = 0, last_or = 0, previous, i;
+    size_t head_active = 0, tail_active = 0;
+    bitset_offset offset, word_offset = 0, count = 0;
+    bitset_word word;
+
+    //Note the last AND (plus one, so that zero means none) before each
+    //bitset, the last AND overall and the last OR or XOR
+    for (i = 0; i < length; i++) {
+        fold->ands[i] = i ? fold->ands[i - 1] : 0;
+        if (i > 1 && fold->types[i - 1] == BITSET_AND) {
+            fold->ands[i] = i;
+        }
+        if (i && fold->types[i] == BITSET_AND) {
+            last_and = i;
+        } else if (i && (fold->types[i] == BITSET_OR || fold->types[i] == BITSET_XOR)) {
+            last_or = i;
+        }
+    }
+    if (result) {
+        result->length = 0;
+    }
+    for (i = 0; i < length; i++) {
+        bitset_cursor_init(&cursors[i], fold->bitsets[i].buffer, fold->bitsets[i].length);
+        if (bitset_cursor_next(&cursors[i])) {
+            bitset_vector_word_heap_push(heap, &heap_length, &cursors[i]);
+            head_active += i <= last_or;
+            tail_active += i >= last_and;
+        }
+    }
+
+    //A word needs a bitset at or after the last AND, and a bitset at or
+    //before the last OR or XOR since only AND and ANDNOT follow it. Stop
+    //once either group of bitsets runs out of words
+    while (head_active && tail_active) {
+        offset = heap[0]->offset;
+        word = 0;
+        previous = 0;
+        while (heap_length && heap[0]->offset == offset) {
+            cursor = bitset_vector_word_heap_pop(heap, &heap_length);
+            i = cursor - cursors;
+
+            //An AND bitset without a word here empties the words before it
+            if (fold->ands[i] > previous) {
+                word = 0;
+            }
+            if (!i) {
+                word = cursor->word;
+            } else {
+                switch (fold->types[i]) {
+                    case BITSET_AND:    word &= cursor->word; break;
+                    case BITSET_OR:     word |= cursor->word; break;
+                    case BITSET_XOR:    word ^= cursor->word; break;
+                    case BITSET_ANDNOT: word &= ~cursor->word; break;
+                }
+            }
+            previous = i + 1;
+            if (bitset_cursor_next(cursor)) {
+                bitset_vector_word_heap_push(heap, &heap_length, cursor);
+            } else {
+                head_active -= i <= last_or;
+                tail_active -= i >= last_and;
+            }
+        }
+        if (last_and && last_and >= previous) {
+            word = 0;
+        }
+        if (!word) {
+            continue;
+        }
+        if (result) {
+            bitset_cursor_append(result, &word_offset, offset, word);
+        } else {
+            BITSET_POP_COUNT(count, word);
+        }
+    }
+    fold->length = 0;
+    return count;
+}
+
+typedef struct bitset_vector_mask_s {
+    bitset_offset *offsets;
+    bitset_word *words;
+    size_t length;
+} bitset_vector_mask_t;
+
+static inline void bitset_vector_mask_init(bitset_vector_mask_t *decoded, const bitset_t *mask) {
+    bitset_cursor_t cursor;
+    size_t size = mask->length ? mask->length : 1;
+    bitset_cursor_init(&cursor, mask->buffer, mask->length);
+    decoded->offsets = bitset_malloc(sizeof(bitset_offset) * size);
+    decoded->words = bitset_malloc(sizeof(bitset_word) * size);
+    if (!decoded->offsets || !decoded->words) {
+        bitset_oom();
+    }
+    decoded->length = 0;
+    while (bitset_cursor_next(&cursor)) {
+        decoded->offsets[decoded->length] = cursor.offset;
+        decoded->words[decoded->length++] = cursor.word;
+    }
+}
+
+static inline void bitset_vector_mask_free(bitset_vector_mask_t *decoded) {
+    bitset_malloc_free(decoded->offsets);
+    bitset_malloc_free(decoded->words);
+}
+
+static inline size_t bitset_vector_mask_gallop(const bitset_vector_mask_t *decoded,
+        size_t position, bitset_offset offset) {
+    size_t step = 1, low = position, high;
+    while (position + step < decoded->length && decoded->offsets[position + step] < offset) {
+        low = position + step;
+        step *= 2;
+    }
+    high = BITSET_MIN(position + step, decoded->length);
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (decoded->offsets[mid] < offset) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+static inline bitset_offset bitset_vector_mask_and_count(const bitset_t *bitset,
+        const bitset_vector_mask_t *decoded) {
+    bitset_cursor_t cursor;
+    bitset_offset count = 0;
+    size_t position = 0;
+    bitset_cursor_init(&cursor, bitset->buffer, bitset->length);
+    while (position < decoded->length && bitset_cursor_next(&cursor)) {
+        if (decoded->offsets[position] < cursor.offset) {
+            position = bitset_vector_mask_gallop(decoded, position, cursor.offset);
+        }
+        if (position < decoded->length && decoded->offsets[position] == cursor.offset) {
+            count += bitset_vector_popcount64(cursor.word & decoded->words[position]);
+        }
+    }
+    return count;
+}
+
+size_t bitset_vector_counts(const bitset_vector_t *vector, unsigned start, unsigned end,
+        const bitset_t *mask, unsigned *offsets, bitset_offset *counts) {
+    char *buffer, *buffer_end = vector->buffer + vector->length;
+    unsigned offset, index;
+    bitset_t bitset;
+    bitset_vector_mask_t decoded = { NULL, NULL, 0 };
+    size_t length = 0;
+    if (mask) {
+        bitset_vector_mask_init(&decoded, mask);
+    }
+    buffer = bitset_vector_seek(vector, start, &offset, &index);
+    while (buffer < buffer_end) {
+        buffer = bitset_vector_advance(buffer, &bitset, &offset);
+        if (end != BITSET_VECTOR_END && offset >= end) {
+            break;
+        }
+        offsets[length] = offset;
+        if (mask) {
+            counts[length] = bitset_vector_mask_and_count(&bitset, &decoded);
+        } else if (vector->popcounts) {
+            counts[length] = vector->popcounts[index + length];
+        } else {
+            counts[length] = bitset_vector_popcount(&bitset);
+        }
+        length++;
+    }
+    if (mask) {
+        bitset_vector_mask_free(&decoded);
+    }
+    return length;
+}
+
+size_t bitset_vector_mask_count(const bitset_vector_t *vector, const bitset_t *mask,
+        unsigned *offsets, bitset_offset *counts) {
+    return bitset_vector_counts(vector, BITSET_VECTOR_START, BITSET_VECTOR_END, mask, offsets, counts);
+}
+
+void bitset_vector_cardinality(const bitset_vector_t *vector, unsigned *raw, unsigned *unique) {
+    bitset_vector_cardinality_with(vector, raw, unique, BITSET_CARDINALITY_LINEAR, 0);
+}
+
+void bitset_vector_cardinality_with(const bitset_vector_t *vector, unsigned *raw, unsigned *unique,
+        enum bitset_vector_cardinality_strategy strategy, double error) {
+    unsigned offset;
+    bitset_t *bitset;
+    *raw = 0;
+    if (vector->popcounts) {
+        for (unsigned i = 0; i < vector->count; i++) {
+            *raw += vector->popcounts[i];
+        }
+    } else {
+        BITSET_VECTOR_FOREACH(vector, bitset, offset) {
+            *raw += bitset_count(bitset);
+        }
+    }
+    if (!unique) {
+        return;
+    } else if (!*raw) {
+        *unique = 0;
+    } else if (strategy == BITSET_CARDINALITY_EXACT) {
+        *unique = bitset_vector_unique_exact(vector);
+    } else if (strategy == BITSET_CARDINALITY_HLL) {
+        bitset_hll_t *counter = bitset_hll_new(error);
+        BITSET_VECTOR_FOREACH(vector, bitset, offset) {
+            bitset_hll_add(counter, bitset);
+        }
+        *unique = bitset_hll_count(counter);
+        bitset_hll_free(counter);
+    } else {
+        bitset_linear_t *counter = bitset_linear_new(*raw * 100);
+        BITSET_VECTOR_FOREACH(vector, bitset, offset) {
+            bitset_linear_add(counter, bitset);
+        }
+        *unique = bitset_linear_count(counter);
+        bitset_linear_free(counter);
+    }
+}
+
+static inline uint32_t bitset_vector_trailer_hash(uint32_t hash, const char *buffer, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ (unsigned char)buffer[i]) * 16777619U;
+    }
+    return hash;
+}
+
+static inline uint32_t bitset_vector_trailer_checksum(const char *trailer,
+        const char *buffer, size_t last) {
+    uint32_t hash = bitset_vector_trailer_hash(2166136261U, trailer, 36);
+    if (bitset_vector_trailer_read(trailer, 8)) {
+        hash = bitset_vector_trailer_hash(hash, buffer, bitset_encoded_length_size(buffer));
+        hash = bitset_vector_trailer_hash(hash, buffer + last, bitset_encoded_length_size(buffer + last));
+    }
+    return hash;
+}
+
+size_t bitset_vector_trailer_length(const bitset_vector_t *vector) {
+    return BITSET_VECTOR_TRAILER_LENGTH + (vector->popcounts ? vector->count * 8 : 0);
+}
+
+void bitset_vector_export_trailer(const bitset_vector_t *vector, char *trailer) {
+    unsigned offset, index;
+    uint64_t raw = 0;
+    size_t last = 0;
+    bitset_t *bitset;
+    if (vector->base_offset && vector->length) {
+        BITSET_FATAL("vector views must be rebased before they're exported");
+    }
+    if (vector->length) {
+        last = bitset_vector_seek(vector, vector->tail_offset, &offset, &index) - vector->buffer;
+    }
+    if (vector->popcounts) {
+        for (unsigned i = 0; i < vector->count; i++, trailer += 8) {
+            raw += vector->popcounts[i];
+            bitset_vector_trailer_write(trailer, vector->popcounts[i], 8);
+        }
+    } else {
+        BITSET_VECTOR_FOREACH(vector, bitset, offset) {
+            raw += bitset_vector_popcount(bitset);
+        }
+    }
+    bitset_vector_trailer_write(trailer, vector->length, 8);
+    bitset_vector_trailer_write(trailer + 8, raw, 8);
+    bitset_vector_trailer_write(trailer + 16, last, 8);
+    bitset_vector_trailer_write(trailer + 24, vector->tail_offset, 4);
+    bitset_vector_trailer_write(trailer + 28, vector->count, 4);
+    bitset_vector_trailer_write(trailer + 32, BITSET_VECTOR_TRAILER_VERSION, 2);
+    bitset_vector_trailer_write(trailer + 34, vector->popcounts ? BITSET_VECTOR_TRAILER_COUNTS : 0, 2);
+    bitset_vector_trailer_write(trailer + 36, bitset_vector_trailer_checksum(trailer, vector->buffer, last), 4);
+    bitset_vector_trailer_write(trailer + 40, BITSET_VECTOR_TRAILER_MAGIC, 4);
+}
+
+bool bitset_vector_read_trailer(const char *buffer, size_t length, bitset_vector_trailer_t *trailer) {
+    size_t trailer_length = BITSET_VECTOR_TRAILER_LENGTH, payload, last, entry;
+    const char *end;
+    if (length < trailer_length) {
+        return false;
+    }
+    end = buffer + length - trailer_length;
+    if (bitset_vector_trailer_read(end + 40, 4) != BITSET_VECTOR_TRAILER_MAGIC) {
+        return false;
+    }
+    if (bitset_vector_trailer_read(end + 34, 2) & BITSET_VECTOR_TRAILER_COUNTS) {
+        trailer_length += bitset_vector_trailer_read(end + 28, 4) * 8;
+    }
+    if (length < trailer_length || bitset_vector_trailer_read(end, 8) != length - trailer_length) {
+        return false;
+    }
+    payload = length - trailer_length;
+    last = bitset_vector_trailer_read(end + 16, 8);
+
+    //The last bitset must end the buffer before its delta is checksummed
+    if (payload) {
+        if (payload < 4 || last > payload - 4) {
+            return false;
+        }
+        entry = last + bitset_encoded_length_size(buffer + last);
+        entry += bitset_encoded_length_size(buffer + entry) +
+            bitset_encoded_length(buffer + entry) * sizeof(bitset_word);
+        if (entry != payload) {
+            return false;
+        }
+    } else if (last) {
+        return false;
+    }
+    if (bitset_vector_trailer_read(end + 36, 4) != bitset_vector_trailer_checksum(end, buffer, last)) {
+        return false;
+    }
+    trailer->length = payload;
+    trailer->raw = bitset_vector_trailer_read(end + 8, 8);
+    trailer->tail_offset = bitset_vector_trailer_read(end + 24, 4);
+    trailer->count = bitset_vector_trailer_read(end + 28, 4);
+    trailer->version = bitset_vector_trailer_read(end + 32, 2);
+    trailer->flags = bitset_vector_trailer_read(end + 34, 2);
+    return true;
+}
+
+bitset_t *bitset_vector_merge(const bitset_vector_t *vector) {
+    unsigned offset;
+    bitset_t *bitset;
+    bitset_operation_t *operation = bitset_operation_new(NULL);
+    BITSET_VECTOR_FOREACH(vector, bitset, offset) {
+        bitset_operation_add(operation, bitset, BITSET_OR);
+    }
+    bitset = bitset_operation_exec(operation);
+    bitset_operation_free(operation);
+    return bitset;
+}
+
+bitset_vector_segmented_t *bitset_vector_segmented_new(size_t segment_size) {
+    bitset_vector_segmented_t *segmented = bitset_malloc(sizeof(bitset_vector_segmented_t));
+    if (!segmented) {
+        bitset_oom();
+    }
+    segmented->segments = NULL;
+    segmented->length = 0;
+    segmented->size = 0;
+    segmented->segment_size = segment_size ? segment_size : 1;
+    segmented->count = 0;
+    return segmented;
+}
+
+void bitset_vector_segmented_free(bitset_vector_segmented_t *segmented) {
+    for (size_t i = 0; i < segmented->length; i++) {
+        bitset_vector_free(segmented->segments[i]);
+    }
+    if (segmented->segments) {
+        bitset_malloc_free(segmented->segments);
+    }
+    bitset_malloc_free(segmented);
+}
+
+static inline bitset_vector_t *bitset_vector_segmented_add(bitset_vector_segmented_t *segmented) {
+    bitset_vector_t *segment = bitset_vector_new();
+    if (segmented->length == segmented->size) {
+        segmented->size = segmented->size ? segmented->size * 2 : 4;
+        segmented->segments = bitset_realloc(segmented->segments, sizeof(bitset_vector_t *) * segmented->size);
+        if (!segmented->segments) {
+            bitset_oom();
+        }
+    }
+    if (segmented->length) {
+        segment->base_offset = segment->tail_offset = segmented->segments[segmented->length - 1]->tail_offset;
+    }
+    bitset_vector_resize(segment, segmented->segment_size);
+    segment->length = 0;
+    segmented->segments[segmented->length++] = segment;
+    return segment;
+}
+
+void bitset_vector_segmented_push(bitset_vector_segmented_t *segmented, const bitset_t *bitset, unsigned offset) {
+    bitset_vector_t *segment = segmented->length ? segmented->segments[segmented->length - 1] : NULL;
+    size_t length = bitset->length * sizeof(bitset_word) + 8;
+    if (segment && segment->length && segment->tail_offset >= offset) {
+        BITSET_FATAL("bitset vectors are append-only");
+    }
+    if (!segment || (segment->length && segment->length + length > segmented->segment_size)) {
+        segment = bitset_vector_segmented_add(segmented);
+    }
+    bitset_vector_encode(segment, bitset, offset - segment->tail_offset);
+    segmented->count++;
+}
+
+unsigned bitset_vector_segmented_bitsets(const bitset_vector_segmented_t *segmented) {
+    return segmented->count;
+}
+
+size_t bitset_vector_segmented_length(const bitset_vector_segmented_t *segmented) {
+    size_t length = 0;
+    for (size_t i = 0; i < segmented->length; i++) {
+        length += segmented->segments[i]->length;
+    }
+    return length;
+}
+
+bool bitset_vector_segmented_get(const bitset_vector_segmented_t *segmented, unsigned offset, bitset_t *bitset) {
+    size_t low = 0, high = segmented->length, mid;
+    while (low < high) {
+        mid = low + (high - low) / 2;
+        if (segmented->segments[mid]->tail_offset < offset) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low < segmented->length && bitset_vector_get(segmented->segments[low], offset, bitset);
+}
+
+bitset_vector_t *bitset_vector_segmented_export(const bitset_vector_segmented_t *segmented) {
+    bitset_vector_t *vector = bitset_vector_new();
+    bitset_vector_resize(vector, bitset_vector_segmented_length(segmented));
+    vector->length = 0;
+    for (size_t i = 0; i < segmented->length; i++) {
+        bitset_vector_concat_slice(vector, segmented->segments[i], 0, BITSET_VECTOR_START, BITSET_VECTOR_END);
+    }
+    return vector;
+}
+
+bitset_vector_buffer_t *bitset_vector_buffer_new(bitset_vector_t *vector, size_t limit) {
+    if (!vector->size) {
+        BITSET_FATAL("vector views are read-only");
+    }
+    bitset_vector_buffer_t *buffer = bitset_malloc(sizeof(bitset_vector_buffer_t));
+    if (!buffer) {
+        bitset_oom();
+    }
+    buffer->vector = vector;
+    buffer->offsets = NULL;
+    buffer->bitsets = NULL;
+    buffer->scratch = bitset_new();
+    buffer->length = 0;
+    buffer->size = 0;
+    buffer->limit = limit;
+    return buffer;
+}
+
+void bitset_vector_buffer_free(bitset_vector_buffer_t *buffer) {
+    bitset_vector_buffer_flush(buffer);
+    if (buffer->size) {
+        bitset_malloc_free(buffer->offsets);
+        bitset_malloc_free(buffer->bitsets);
+    }
+    bitset_free(buffer->scratch);
+    bitset_malloc_free(buffer);
+}
+
+static inline bitset_t *bitset_vector_buffer_pending(bitset_vector_buffer_t *buffer, unsigned offset,
+        size_t *index) {
+    size_t low = 0, high = buffer->length, mid;
+    while (low < high) {
+        mid = low + (high - low) / 2;
+        if (buffer->offsets[mid] < offset) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    *index = low;
+    if (low < buffer->length && buffer->offsets[low] == offset) {
+        return buffer->bitsets[low];
+    }
+    if (buffer->length == buffer->size) {
+        buffer->size = buffer->size ? buffer->size * 2 : 16;
+        buffer->offsets = bitset_realloc(buffer->offsets, sizeof(unsigned) * buffer->size);
+        buffer->bitsets = bitset_realloc(buffer->bitsets, sizeof(bitset_t *) * buffer->size);
+        if (!buffer->offsets || !buffer->bitsets) {
+            bitset_oom();
+        }
+    }
+    memmove(buffer->offsets + low + 1, buffer->offsets + low, sizeof(unsigned) * (buffer->length - low));
+    memmove(buffer->bitsets + low + 1, buffer->bitsets + low, sizeof(bitset_t *) * (buffer->length - low));
+    buffer->offsets[low] = offset;
+    buffer->bitsets[low] = bitset_new();
+    buffer->length++;
+    return buffer->bitsets[low];
+}
+
+static inline void bitset_vector_buffer_check(bitset_vector_buffer_t *buffer) {
+    if (buffer->limit && buffer->length >= buffer->limit) {
+        bitset_vector_buffer_flush(buffer);
+    }
+}
+
+static inline void bitset_vector_buffer_or(const bitset_t *a, const bitset_t *b, bitset_t *result) {
+    bitset_cursor_t left, right;
+    bitset_offset word_offset = 0;
+    bool has_left, has_right;
+    result->length = 0;
+    bitset_cursor_init(&left, a->buffer, a->length);
+    bitset_cursor_init(&right, b->buffer, b->length);
+    has_left = bitset_cursor_next(&left);
+    has_right = bitset_cursor_next(&right);
+    while (has_left || has_right) {
+        if (!has_right || (has_left && left.offset < right.offset)) {
+            bitset_cursor_append(result, &word_offset, left.offset, left.word);
+            has_left = bitset_cursor_next(&left);
+        } else if (!has_left || right.offset < left.offset) {
+            bitset_cursor_append(result, &word_offset, right.offset, right.word);
+            has_right = bitset_cursor_next(&right);
+        } else {
+            bitset_cursor_append(result, &word_offset, left.offset, left.word | right.word);
+            has_left = bitset_cursor_next(&left);
+            has_right = bitset_cursor_next(&right);
+        }
+    }
+}
+
+void bitset_vector_buffer_push(bitset_vector_buffer_t *buffer, const bitset_t *bitset, unsigned offset) {
+    bitset_vector_t *vector = buffer->vector;
+    bitset_t *pending;
+    size_t index;
+    //In-order bitsets go straight to the vector
+    if (!buffer->length && (!vector->length || offset > vector->tail_offset)) {
+        bitset_vector_push(vector, bitset, offset);
+        return;
+    }
+
+    //Late bitsets are copied into an empty pending bitset, or merged with
+    //its words into the buffer's scratch bitset which then takes its place
+    pending = bitset_vector_buffer_pending(buffer, offset, &index);
+    if (bitset->length && !pending->length) {
+        bitset_resize(pending, bitset->length);
+        memcpy(pending->buffer, bitset->buffer, sizeof(bitset_word) * bitset->length);
+    } else if (bitset->length) {
+        bitset_vector_buffer_or(pending, bitset, buffer->scratch);
+        buffer->bitsets[index] = buffer->scratch;
+        buffer->scratch = pending;
+    }
+    bitset_vector_buffer_check(buffer);
+}
+
+void bitset_vector_buffer_set(bitset_vector_buffer_t *buffer, unsigned offset, bitset_offset bit) {
+    size_t index;
+    bitset_set(bitset_vector_buffer_pending(buffer, offset, &index), bit);
+    bitset_vector_buffer_check(buffer);
+}
+
+void bitset_vector_buffer_flush(bitset_vector_buffer_t *buffer) {
+    bitset_vector_t *vector = buffer->vector, *pending, *merged;
+    bitset_vector_t *vectors[2];
+    unsigned interval;
+    if (!buffer->length) {
+        return;
+    }
+    //Append pending bitsets when they all follow the vector, otherwise merge
+    //them in and replace the vector's buffer
+    if (!vector->length || buffer->offsets[0] > vector->tail_offset) {
+        for (size_t i = 0; i < buffer->length; i++) {
+            if (buffer->bitsets[i]->length) {
+                bitset_vector_push(vector, buffer->bitsets[i], buffer->offsets[i]);
+            }
+        }
+    } else {
+        pending = bitset_vector_new();
+        for (size_t i = 0; i < buffer->length; i++) {
+            if (buffer->bitsets[i]->length) {
+                bitset_vector_push(pending, buffer->bitsets[i], buffer->offsets[i]);
+            }
+        }
+        vectors[0] = vector;
+        vectors[1] = pending;
+        merged = bitset_vector_merge_many(vectors, 2, BITSET_OR);
+        bitset_vector_free(pending);
+        interval = vector->directory ? vector->directory->interval : 0;
+        if (vector->directory) {
+            bitset_vector_directory_free(vector->directory);
+        }
+        bitset_malloc_free(vector->buffer);
+        if (vector->popcounts_size) {
+            bitset_malloc_free(vector->popcounts);
+        }
+        *vector = *merged;
+        bitset_malloc_free(merged);
+        if (interval) {
+            bitset_vector_build_directory(vector, interval);
+        }
+    }
+    for (size_t i = 0; i < buffer->length; i++) {
+        bitset_free(buffer->bitsets[i]);
+    }
+    buffer->length = 0;
+}
+
+bitset_vector_operation_t *bitset_vector_operation_new(bitset_vector_t *vector) {
+    bitset_vector_operation_t *operation = bitset_malloc(sizeof(bitset_vector_operation_t));
+    if (!operation) {
+        bitset_oom();
+    }
+    operation->length = 0;
+    operation->start = BITSET_VECTOR_START;
+    operation->end = BITSET_VECTOR_END;
+    if (vector) {
+        bitset_vector_operation_add(operation, vector, BITSET_OR);
+    }
+    return operation;
+}
+
+void bitset_vector_operation_free(bitset_vector_operation_t *operation) {
+    if (operation->length) {
+        for (size_t i = 0; i < operation->length; i++) {
+            if (operation->steps[i]->is_nested) {
+                if (operation->steps[i]->is_operation) {
+                    bitset_vector_operation_free(operation->steps[i]->data.operation);
+                } else {
+                    bitset_vector_free(operation->steps[i]->data.vector);
+                }
+            }
+            bitset_malloc_free(operation->steps[i]);
+        }
+        bitset_malloc_free(operation->steps);
+    }
+    bitset_malloc_free(operation);
+}
+
+void bitset_vector_operation_free_operands(bitset_vector_operation_t *operation) {
+    if (operation->length) {
+        for (size_t i = 0; i < operation->length; i++) {
+            if (operation->steps[i]->is_nested) {
+                if (operation->steps[i]->is_operation) {
+                    bitset_vector_operation_free_operands(operation->steps[i]->data.operation);
+                }
+            } else {
+                if (operation->steps[i]->data.vector) {
+                    bitset_vector_free(operation->steps[i]->data.vector);
+                }
+                operation->steps[i]->data.vector = NULL;
+            }
+        }
+    }
+}
+
+static inline bitset_vector_operation_step_t *
+        bitset_vector_operation_add_step(bitset_vector_operation_t *operation) {
+    bitset_vector_operation_step_t *step = bitset_malloc(sizeof(bitset_vector_operation_step_t));
+    if (!step) {
+        bitset_oom();
+    }
+    if (operation->length % 2 == 0) {
+        if (!operation->length) {
+            operation->steps = bitset_malloc(sizeof(bitset_vector_operation_step_t *) * 2);
+        } else {
+            operation->steps = bitset_realloc(operation->steps, sizeof(bitset_vector_operation_step_t *) * operation->length * 2);
+        }
+        if (!operation->steps) {
+            bitset_oom();
+        }
+    }
+    step->userdata = NULL;
+    step->shift = 0;
+    operation->steps[operation->length++] = step;
+    return step;
+}
+
+void bitset_vector_operation_add(bitset_vector_operation_t *operation,
         bitset_vector_t *vector, enum bitset_operation_type type) {
     if (!vector->length) {
         return;
     }
-    bitset_vector_operation_step_t *step = bitset_vector_operation_add_step(operation);
-    step->is_nested = false;
-    step->is_operation = false;
-    step->data.vector = vector;
-    step->type = type;
-    unsigned start = 0, end = 0;
-    bitset_vector_start_end(vector, &start, &end);
-    operation->min = BITSET_MIN(operation->min, start);
-    operation->max = BITSET_MAX(operation->max, end);
+    bitset_vector_operation_step_t *step = bitset_vector_operation_add_step(operation);
+    step->is_nested = false;
+    step->is_operation = false;
+    step->data.vector = vector;
+    step->type = type;
+}
+
+void bitset_vector_operation_set_range(bitset_vector_operation_t *operation, unsigned start, unsigned end) {
+    operation->start = start;
+    operation->end = end;
+}
+
+void bitset_vector_operation_add_shifted(bitset_vector_operation_t *operation,
+        bitset_vector_t *vector, int shift, enum bitset_operation_type type) {
+    if (!vector->length) {
+        return;
+    }
+    bitset_vector_operation_step_t *step = bitset_vector_operation_add_step(operation);
+    step->is_nested = false;
+    step->is_operation = false;
+    step->data.vector = vector;
+    step->type = type;
+    step->shift = shift;
+}
+
+void bitset_vector_operation_add_nested(bitset_vector_operation_t *operation,
+        bitset_vector_operation_t *nested, enum bitset_operation_type type) {
+    bitset_vector_operation_step_t *step = bitset_vector_operation_add_step(operation);
+    step->is_nested = true;
+    step->is_operation = true;
+    step->data.operation = nested;
+    step->type = type;
+}
+
+void bitset_vector_operation_add_data(bitset_vector_operation_t *operation,
+        void *data, enum bitset_operation_type type) {
+    bitset_vector_operation_step_t *step = bitset_vector_operation_add_step(operation);
+    step->is_nested = false;
+    step->is_operation = false;
+    step->data.vector = NULL;
+    step->type = type;
+    step->userdata = data;
+}
+
+void bitset_vector_operation_resolve_data(bitset_vector_operation_t *operation,
+        bitset_vector_t *(*resolve_fn)(void *, void *), void *context) {
+    if (operation->length) {
+        for (size_t j = 0; j < operation->length; j++) {
+            if (operation->steps[j]->is_operation) {
+                bitset_vector_operation_resolve_data(operation->steps[j]->data.operation, resolve_fn, context);
+            } else if (operation->steps[j]->userdata) {
+                operation->steps[j]->data.vector = resolve_fn(operation->steps[j]->userdata, context);
+            }
+        }
+    }
+}
+
+void bitset_vector_operation_free_data(bitset_vector_operation_t *operation, void (*free_fn)(void *)) {
+    if (operation->length) {
+        for (size_t j = 0; j < operation->length; j++) {
+            if (operation->steps[j]->is_operation) {
+                bitset_vector_operation_free_data(operation->steps[j]->data.operation, free_fn);
+            } else if (operation->steps[j]->userdata) {
+                free_fn(operation->steps[j]->userdata);
+            }
+        }
+    }
+}
+
+typedef struct bitset_vector_cursor_s {
+    char *buffer;
+    char *end;
+    unsigned offset;
+    size_t step;
+    size_t next;
+    int shift;
+    const bitset_offset *popcounts;
+    bitset_t bitset;
+} bitset_vector_cursor_t;
+
+static inline void bitset_vector_cursor_init(bitset_vector_cursor_t *cursor,
+        const bitset_vector_t *vector, size_t step, int shift, unsigned start) {
+    int64_t target = (int64_t) start - shift;
+    unsigned previous, index;
+    cursor->buffer = cursor->end = NULL;
+    cursor->offset = 0;
+    cursor->step = step;
+    cursor->shift = shift;
+    cursor->next = 0;
+    cursor->popcounts = NULL;
+    if (!vector || target > UINT_MAX) {
+        return;
+    }
+    //Offsets are shifted as they're decoded. Bitsets that would be shifted
+    //below zero or past UINT_MAX are skipped
+    cursor->buffer = bitset_vector_seek(vector, target < 0 ? 0 : (unsigned) target, &previous, &index);
+    cursor->end = vector->buffer + vector->length;
+    cursor->next = index;
+    cursor->popcounts = vector->popcounts;
+    if ((int64_t) previous + shift > UINT_MAX) {
+        cursor->buffer = cursor->end;
+        return;
+    }
+    cursor->offset = previous + (unsigned) shift;
+}
+
+static inline bool bitset_vector_cursor_next(bitset_vector_cursor_t *cursor) {
+    unsigned previous = cursor->offset;
+    if (cursor->buffer >= cursor->end) {
+        return false;
+    }
+    cursor->buffer = bitset_vector_advance(cursor->buffer, &cursor->bitset, &cursor->offset);
+    cursor->next++;
+
+    //Deltas are unsigned, so a positively shifted offset that passed
+    //UINT_MAX wraps below the previous offset, as would every offset after it
+    if (cursor->shift > 0 && cursor->offset < previous) {
+        cursor->buffer = cursor->end;
+        return false;
+    }
+    return true;
+}
+
+static inline bool bitset_vector_cursor_less(const bitset_vector_cursor_t *a, const bitset_vector_cursor_t *b) {
+    return a->offset < b->offset || (a->offset == b->offset && a->step < b->step);
+}
+
+static inline void bitset_vector_heap_push(bitset_vector_cursor_t **heap, size_t *length,
+        bitset_vector_cursor_t *cursor) {
+    size_t i = (*length)++, parent;
+    for (; i; i = parent) {
+        parent = (i - 1) / 2;
+        if (!bitset_vector_cursor_less(cursor, heap[parent])) {
+            break;
+        }
+        heap[i] = heap[parent];
+    }
+    heap[i] = cursor;
+}
+
+static inline bitset_vector_cursor_t *bitset_vector_heap_pop(bitset_vector_cursor_t **heap, size_t *length) {
+    bitset_vector_cursor_t *top = heap[0], *last = heap[--(*length)];
+    size_t i = 0, child;
+    while ((child = i * 2 + 1) < *length) {
+        if (child + 1 < *length && bitset_vector_cursor_less(heap[child + 1], heap[child])) {
+            child++;
+        }
+        if (!bitset_vector_cursor_less(heap[child], last)) {
+            break;
+        }
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = last;
+    return top;
+}
+
+typedef struct bitset_vector_counter_s {
+    unsigned *offsets;
+    bitset_offset *counts;
+    size_t length;
+    size_t size;
+    bitset_offset raw;
+} bitset_vector_counter_t;
+
+static inline void bitset_vector_counter_add(bitset_vector_counter_t *counter, unsigned offset, bitset_offset count) {
+    if (!count) {
+        return;
+    }
+    counter->raw += count;
+    if (counter->length == counter->size) {
+        counter->size = counter->size ? counter->size * 2 : 16;
+        counter->offsets = bitset_realloc(counter->offsets, sizeof(unsigned) * counter->size);
+        counter->counts = bitset_realloc(counter->counts, sizeof(bitset_offset) * counter->size);
+        if (!counter->offsets || !counter->counts) {
+            bitset_oom();
+        }
+    }
+    counter->offsets[counter->length] = offset;
+    counter->counts[counter->length++] = count;
 }
 
-void bitset_vector_operation_add_nested(bitset_vector_operation_t *operation,
-        bitset_vector_operation_t *nested, enum bitset_operation_type type) {
-    bitset_vector_operation_step_t *step = bitset_vector_operation_add_step(operation);
-    step->is_nested = true;
-    step->is_operation = true;
-    step->data.operation = nested;
-    step->type = type;
-    operation->min = BITSET_MIN(operation->min, nested->min);
-    operation->max = BITSET_MAX(operation->max, nested->max);
+static bitset_vector_t *bitset_vector_operation_merge(const enum bitset_operation_type *types,
+        bitset_vector_t **vectors, const int *shifts, size_t length, unsigned start, unsigned end,
+        bitset_vector_counter_t *counter) {
+    bitset_vector_t *result;
+    bitset_vector_cursor_t *cursors, *cursor, **heap, **matched, *single = NULL;
+    bitset_vector_fold_t fold = { NULL, NULL, NULL, NULL, NULL, 0, 0 };
+    bitset_t *bitset;
+    size_t heap_length = 0, matched_length, previous;
+    size_t *last_and;
+    enum bitset_operation_type type;
+    unsigned offset;
+
+    cursors = bitset_malloc(sizeof(bitset_vector_cursor_t) * length);
+    heap = bitset_malloc(sizeof(bitset_vector_cursor_t *) * length);
+    matched = bitset_malloc(sizeof(bitset_vector_cursor_t *) * length);
+    last_and = bitset_malloc(sizeof(size_t) * length);
+    if (!cursors || !heap || !matched || !last_and) {
+        bitset_oom();
+    }
+
+    //Position a cursor at the first bitset of each vector, and note the
+    //last AND step (plus one, so that zero means none) up to each step
+    for (size_t i = 0; i < length; i++) {
+        if (i && types[i] == BITSET_AND) {
+            last_and[i] = i + 1;
+        } else {
+            last_and[i] = i ? last_and[i - 1] : 0;
+        }
+        bitset_vector_cursor_init(&cursors[i], vectors[i], i, shifts ? shifts[i] : 0, start);
+        if (bitset_vector_cursor_next(&cursors[i])) {
+            bitset_vector_heap_push(heap, &heap_length, &cursors[i]);
+        }
+    }
+
+    result = counter ? NULL : bitset_vector_new();
+    bitset = bitset_new();
+    for (size_t i = 0; result && i < length; i++) {
+        if (vectors[i] && vectors[i]->popcounts) {
+            bitset_vector_store_counts(result);
+            break;
+        }
+    }
+
+    //Merge the vectors in offset order, folding together the bitsets from
+    //each step that has an entry at the offset. Memory use is proportional
+    //to the number of steps rather than the span of offsets
+    while (heap_length && (end == BITSET_VECTOR_END || heap[0]->offset < end)) {
+        offset = heap[0]->offset;
+        matched_length = 0;
+        while (heap_length && heap[0]->offset == offset) {
+            matched[matched_length++] = bitset_vector_heap_pop(heap, &heap_length);
+        }
+
+        //Steps are popped in order. An AND step without an entry at this
+        //offset empties the result so far
+        fold.length = 0;
+        previous = 0;
+        for (size_t i = 0; i < matched_length; i++) {
+            cursor = matched[i];
+            if (cursor->step && last_and[cursor->step - 1] > previous) {
+                fold.length = 0;
+            }
+            type = cursor->step ? types[cursor->step] : BITSET_OR;
+            if (fold.length || type == BITSET_OR || type == BITSET_XOR) {
+                bitset_vector_fold_add(&fold, &cursor->bitset, type);
+                single = cursor;
+            }
+            previous = cursor->step + 1;
+        }
+        if (last_and[length - 1] > previous) {
+            fold.length = 0;
+        }
+
+        //Copy bitsets that only appear in one step as-is, and fold the rest
+        //with a streaming word merge. When counting, the result is never
+        //materialised and stored popcounts are used where there are any
+        if (fold.length == 1) {
+            if (counter && single->popcounts) {
+                bitset_vector_counter_add(counter, offset, single->popcounts[single->next - 1]);
+            } else if (counter) {
+                bitset_vector_counter_add(counter, offset, bitset_vector_popcount(&fold.bitsets[0]));
+            } else {
+                bitset_vector_encode(result, &fold.bitsets[0], offset - result->tail_offset);
+            }
+        } else if (fold.length) {
+            if (counter) {
+                bitset_vector_counter_add(counter, offset, bitset_vector_fold_exec(&fold, NULL));
+            } else {
+                bitset_vector_fold_exec(&fold, bitset);
+                if (bitset->length) {
+                    bitset_vector_encode(result, bitset, offset - result->tail_offset);
+                }
+            }
+        }
+
+        for (size_t i = 0; i < matched_length; i++) {
+            if (bitset_vector_cursor_next(matched[i])) {
+                bitset_vector_heap_push(heap, &heap_length, matched[i]);
+            }
+        }
+    }
+
+    bitset_free(bitset);
+    bitset_malloc_free(cursors);
+    bitset_malloc_free(heap);
+    bitset_malloc_free(matched);
+    bitset_vector_fold_free(&fold);
+    bitset_malloc_free(last_and);
+
+    return result;
 }
 
-void bitset_vector_operation_add_data(bitset_vector_operation_t *operation,
-        void *data, enum bitset_operation_type type) {
-    bitset_vector_operation_step_t *step = bitset_vector_operation_add_step(operation);
-    step->is_nested = false;
-    step->is_operation = false;
-    step->data.vector = NULL;
-    step->type = type;
-    step->userdata = data;
+bitset_vector_t *bitset_vector_merge_many(bitset_vector_t **vectors, size_t length,
+        enum bitset_operation_type type) {
+    if (!length) {
+        return bitset_vector_new();
+    }
+    enum bitset_operation_type *types = bitset_malloc(sizeof(enum bitset_operation_type) * length);
+    if (!types) {
+        bitset_oom();
+    }
+    for (size_t i = 0; i < length; i++) {
+        types[i] = type;
+    }
+    bitset_vector_t *result = bitset_vector_operation_merge(types, vectors, NULL, length,
+        BITSET_VECTOR_START, BITSET_VECTOR_END, NULL);
+    bitset_malloc_free(types);
+    return result;
 }
 
-void bitset_vector_operation_resolve_data(bitset_vector_operation_t *operation,
-        bitset_vector_t *(*resolve_fn)(void *, void *), void *context) {
-    unsigned start, end;
-    if (operation->length) {
-        for (size_t j = 0; j < operation->length; j++) {
-            start = 0;
-            end = 0;
-            if (operation->steps[j]->is_operation) {
-                bitset_vector_operation_resolve_data(operation->steps[j]->data.operation, resolve_fn, context);
-            } else if (operation->steps[j]->userdata) {
-                bitset_vector_t *vector = resolve_fn(operation->steps[j]->userdata, context);
-                operation->steps[j]->data.vector = vector;
-                if (vector && vector->length) {
-                    bitset_vector_start_end(vector, &start, &end);
-                    operation->min = BITSET_MIN(operation->min, start);
-                    operation->max = BITSET_MAX(operation->max, end);
+typedef struct bitset_vector_task_s {
+    void (*fn)(void *, size_t);
+    void *context;
+    size_t tasks;
+    size_t first;
+    unsigned stride;
+} bitset_vector_task_t;
+
+static void *bitset_vector_task_run(void *arg) {
+    bitset_vector_task_t *task = (bitset_vector_task_t *) arg;
+    for (size_t i = task->first; i < task->tasks; i += task->stride) {
+        task->fn(task->context, i);
+    }
+    return NULL;
+}
+
+static void bitset_vector_parallel(size_t tasks, unsigned threads,
+        void (*fn)(void *, size_t), void *context) {
+    if (threads > tasks) {
+        threads = tasks;
+    }
+#ifdef HAVE_PTHREAD_H
+    if (threads > 1) {
+        pthread_t *ids = bitset_malloc(sizeof(pthread_t) * threads);
+        bitset_vector_task_t *task = bitset_malloc(sizeof(bitset_vector_task_t) * threads);
+        bool *started = bitset_malloc(sizeof(bool) * threads);
+        if (!ids || !task || !started) {
+            bitset_oom();
+        }
+        for (unsigned i = 0; i < threads; i++) {
+            task[i].fn = fn;
+            task[i].context = context;
+            task[i].tasks = tasks;
+            task[i].first = i;
+            task[i].stride = threads;
+            started[i] = !pthread_create(&ids[i], NULL, bitset_vector_task_run, &task[i]);
+            if (!started[i]) {
+                bitset_vector_task_run(&task[i]);
+            }
+        }
+        for (unsigned i = 0; i < threads; i++) {
+            if (started[i]) {
+                pthread_join(ids[i], NULL);
+            }
+        }
+        bitset_malloc_free(ids);
+        bitset_malloc_free(task);
+        bitset_malloc_free(started);
+        return;
+    }
+#endif
+    for (size_t i = 0; i < tasks; i++) {
+        fn(context, i);
+    }
+}
+
+typedef struct bitset_vector_operation_pending_s {
+    bitset_vector_operation_step_t **steps;
+    void **data;
+    bitset_vector_t **vectors;
+    size_t length;
+    size_t size;
+    bitset_vector_t *(*resolve_fn)(void *, void *);
+    void *context;
+} bitset_vector_operation_pending_t;
+
+static void bitset_vector_operation_pending_collect(bitset_vector_operation_pending_t *pending,
+        bitset_vector_operation_t *operation) {
+    for (size_t j = 0; j < operation->length; j++) {
+        if (operation->steps[j]->is_operation) {
+            bitset_vector_operation_pending_collect(pending, operation->steps[j]->data.operation);
+        } else if (operation->steps[j]->userdata) {
+            if (pending->length == pending->size) {
+                pending->size = pending->size ? pending->size * 2 : 16;
+                pending->steps = bitset_realloc(pending->steps,
+                    sizeof(bitset_vector_operation_step_t *) * pending->size);
+                pending->data = bitset_realloc(pending->data, sizeof(void *) * pending->size);
+                if (!pending->steps || !pending->data) {
+                    bitset_oom();
                 }
             }
+            pending->steps[pending->length] = operation->steps[j];
+            pending->data[pending->length++] = operation->steps[j]->userdata;
         }
     }
 }
 
-void bitset_vector_operation_free_data(bitset_vector_operation_t *operation, void (*free_fn)(void *)) {
-    if (operation->length) {
-        for (size_t j = 0; j < operation->length; j++) {
-            if (operation->steps[j]->is_operation) {
-                bitset_vector_operation_free_data(operation->steps[j]->data.operation, free_fn);
-            } else if (operation->steps[j]->userdata) {
-                free_fn(operation->steps[j]->userdata);
+static void bitset_vector_operation_pending_init(bitset_vector_operation_pending_t *pending,
+        bitset_vector_operation_t *operation) {
+    pending->steps = NULL;
+    pending->data = NULL;
+    pending->length = pending->size = 0;
+    bitset_vector_operation_pending_collect(pending, operation);
+    pending->vectors = bitset_calloc(pending->length ? pending->length : 1, sizeof(bitset_vector_t *));
+    if (!pending->vectors) {
+        bitset_oom();
+    }
+}
+
+static void bitset_vector_operation_pending_finish(bitset_vector_operation_pending_t *pending) {
+    for (size_t i = 0; i < pending->length; i++) {
+        pending->steps[i]->data.vector = pending->vectors[i];
+    }
+    if (pending->size) {
+        bitset_malloc_free(pending->steps);
+        bitset_malloc_free(pending->data);
+    }
+    bitset_malloc_free(pending->vectors);
+}
+
+static void bitset_vector_operation_pending_resolve(void *context, size_t task) {
+    bitset_vector_operation_pending_t *pending = (bitset_vector_operation_pending_t *) context;
+    pending->vectors[task] = pending->resolve_fn(pending->data[task], pending->context);
+}
+
+void bitset_vector_operation_resolve_data_bulk(bitset_vector_operation_t *operation,
+        void (*resolve_fn)(void **, bitset_vector_t **, size_t, void *), void *context) {
+    bitset_vector_operation_pending_t pending;
+    bitset_vector_operation_pending_init(&pending, operation);
+    if (pending.length) {
+        resolve_fn(pending.data, pending.vectors, pending.length, context);
+    }
+    bitset_vector_operation_pending_finish(&pending);
+}
+
+void bitset_vector_operation_resolve_data_parallel(bitset_vector_operation_t *operation,
+        bitset_vector_t *(*resolve_fn)(void *, void *), void *context, unsigned threads) {
+    bitset_vector_operation_pending_t pending;
+    bitset_vector_operation_pending_init(&pending, operation);
+    pending.resolve_fn = resolve_fn;
+    pending.context = context;
+    bitset_vector_parallel(pending.length, threads, bitset_vector_operation_pending_resolve, &pending);
+    bitset_vector_operation_pending_finish(&pending);
+}
+
+typedef struct bitset_vector_operation_range_s {
+    const enum bitset_operation_type *types;
+    bitset_vector_t **vectors;
+    const int *shifts;
+    size_t length;
+    bitset_vector_t **results;
+    unsigned *splits;
+} bitset_vector_operation_range_t;
+
+static void bitset_vector_operation_exec_range(void *context, size_t task) {
+    bitset_vector_operation_range_t *range = (bitset_vector_operation_range_t *) context;
+    range->results[task] = bitset_vector_operation_merge(range->types, range->vectors, range->shifts,
+        range->length, range->splits[task], range->splits[task + 1], NULL);
+}
+
+static void bitset_vector_operation_flatten(bitset_vector_operation_t *operation, unsigned threads) {
+    bitset_vector_operation_t *nested;
+    for (size_t i = 0; i < operation->length; i++) {
+        if (operation->steps[i]->is_operation) {
+            nested = operation->steps[i]->data.operation;
+            if (nested->start == BITSET_VECTOR_START && nested->end == BITSET_VECTOR_END) {
+                bitset_vector_operation_set_range(nested, operation->start, operation->end);
             }
+            operation->steps[i]->data.vector = bitset_vector_operation_exec_parallel(nested, threads);
+            operation->steps[i]->is_operation = false;
+            bitset_vector_operation_free(nested);
         }
     }
 }
 
 bitset_vector_t *bitset_vector_operation_exec(bitset_vector_operation_t *operation) {
+    return bitset_vector_operation_exec_parallel(operation, 1);
+}
+
+size_t bitset_vector_operation_count(bitset_vector_operation_t *operation, bitset_offset *raw,
+        unsigned **offsets, bitset_offset **counts) {
+    bitset_vector_counter_t counter = { NULL, NULL, 0, 0, 0 };
+    size_t length = operation->length;
+    bitset_vector_operation_flatten(operation, 1);
+    if (length) {
+        bitset_vector_t **vectors = bitset_malloc(sizeof(bitset_vector_t *) * length);
+        enum bitset_operation_type *types = bitset_malloc(sizeof(enum bitset_operation_type) * length);
+        int *shifts = bitset_malloc(sizeof(int) * length);
+        if (!vectors || !types || !shifts) {
+            bitset_oom();
+        }
+        for (size_t i = 0; i < length; i++) {
+            types[i] = operation->steps[i]->type;
+            vectors[i] = operation->steps[i]->data.vector;
+            shifts[i] = operation->steps[i]->shift;
+        }
+        bitset_vector_operation_merge(types, vectors, shifts, length,
+            operation->start, operation->end, &counter);
+        bitset_malloc_free(vectors);
+        bitset_malloc_free(types);
+        bitset_malloc_free(shifts);
+    }
+    if (raw) {
+        *raw = counter.raw;
+    }
+    if (offsets) {
+        *offsets = counter.offsets;
+    } else if (counter.offsets) {
+        bitset_malloc_free(counter.offsets);
+    }
+    if (counts) {
+        *counts = counter.counts;
+    } else if (counter.counts) {
+        bitset_malloc_free(counter.counts);
+    }
+    return counter.length;
+}
+
+bitset_vector_t *bitset_vector_operation_exec_parallel(bitset_vector_operation_t *operation, unsigned threads) {
     if (!operation->length) {
         return bitset_vector_new();
-    } else if (operation->length == 1 && !operation->steps[0]->is_operation) {
-        return bitset_vector_copy(operation->steps[0]->data.vector);
     }
 
-    bitset_vector_t *vector, *result;
-    bitset_t *bitset_ptr, bitset;
-    bitset_operation_t *nested;
+    bitset_vector_t *vector, *result, *largest = NULL, *view, **vectors;
+    enum bitset_operation_type *types;
+    int *shifts;
+    bitset_vector_operation_range_t range;
+    bitset_t *bitset;
+    size_t length = operation->length, tasks = 1, split = 1, index = 0;
     unsigned offset;
-    char *buffer, *next, *bitset_buffer;
-    size_t bitset_length, buckets, key, copy_length, offset_bytes;
-    void **bucket, **and_bucket;
+
+    bitset_vector_operation_flatten(operation, threads);
+    if (length == 1 && !operation->steps[0]->shift) {
+        vector = operation->steps[0]->data.vector;
+        if (!vector) {
+            return bitset_vector_new();
+        } else if (operation->start == BITSET_VECTOR_START && operation->end == BITSET_VECTOR_END) {
+            return bitset_vector_copy(vector);
+        }
+        view = bitset_vector_view(vector, operation->start, operation->end);
+        result = bitset_vector_copy(view);
+        bitset_vector_free(view);
+        return result;
+    }
+
+    vectors = bitset_malloc(sizeof(bitset_vector_t *) * length);
+    types = bitset_malloc(sizeof(enum bitset_operation_type) * length);
+    shifts = bitset_malloc(sizeof(int) * length);
+    if (!vectors || !types || !shifts) {
+        bitset_oom();
+    }
+    for (size_t i = 0; i < length; i++) {
+        types[i] = operation->steps[i]->type;
+        vectors[i] = operation->steps[i]->data.vector;
+        shifts[i] = operation->steps[i]->shift;
+        if (vectors[i] && !shifts[i] && (!largest || vectors[i]->count > largest->count)) {
+            largest = vectors[i];
+        }
+    }
+    view = largest ? bitset_vector_view(largest, operation->start, operation->end) : NULL;
+    if (threads > 1 && view) {
+        tasks = BITSET_MIN(threads, view->count);
+    }
+    if (tasks <= 1) {
+        if (view) {
+            bitset_vector_free(view);
+        }
+        result = bitset_vector_operation_merge(types, vectors, shifts, length,
+            operation->start, operation->end, NULL);
+        bitset_malloc_free(vectors);
+        bitset_malloc_free(types);
+        bitset_malloc_free(shifts);
+        return result;
+    }
+
+    //Split the offset range so that each task gets an equal share of the
+    //largest unshifted operand's bitsets, then merge each range independently
+    range.types = types;
+    range.vectors = vectors;
+    range.shifts = shifts;
+    range.length = length;
+    range.results = bitset_malloc(sizeof(bitset_vector_t *) * tasks);
+    range.splits = bitset_malloc(sizeof(unsigned) * (tasks + 1));
+    if (!range.results || !range.splits) {
+        bitset_oom();
+    }
+    range.splits[0] = operation->start;
+    range.splits[tasks] = operation->end;
+    BITSET_VECTOR_FOREACH(view, bitset, offset) {
+        if (split < tasks && index == split * view->count / tasks) {
+            range.splits[split++] = offset;
+        }
+        index++;
+    }
+    bitset_vector_free(view);
+    bitset_vector_parallel(tasks, threads, bitset_vector_operation_exec_range, &range);
+
+    result = range.results[0];
+    for (size_t i = 1; i < tasks; i++) {
+        bitset_vector_concat_slice(result, range.results[i], 0, BITSET_VECTOR_START, BITSET_VECTOR_END);
+        bitset_vector_free(range.results[i]);
+    }
+    bitset_malloc_free(range.results);
+    bitset_malloc_free(range.splits);
+    bitset_malloc_free(vectors);
+    bitset_malloc_free(types);
+    bitset_malloc_free(shifts);
+
+    return result;
+}
+
+static inline void bitset_vector_rollup_flush(bitset_vector_t *result, unsigned offset,
+        bitset_vector_fold_t *fold, bitset_t *scratch) {
+    if (result->length && offset <= result->tail_offset) {
+        BITSET_FATAL("rollup buckets must increase with offset");
+    }
+    if (fold->length == 1) {
+        bitset_vector_encode(result, &fold->bitsets[0], offset - result->tail_offset);
+        fold->length = 0;
+    } else {
+        bitset_vector_fold_exec(fold, scratch);
+        if (scratch->length) {
+            bitset_vector_encode(result, scratch, offset - result->tail_offset);
+        }
+    }
+}
+
+static void bitset_vector_rollup_into(bitset_vector_t *result, const bitset_vector_t *vector,
+        unsigned (*bucket_fn)(unsigned, void *), void *context, enum bitset_operation_type type) {
+    bitset_vector_fold_t fold = { NULL, NULL, NULL, NULL, NULL, 0, 0 };
+    bitset_t *bitset, *scratch = bitset_new();
+    unsigned offset, current = 0, next;
+    BITSET_VECTOR_FOREACH(vector, bitset, offset) {
+        next = bucket_fn(offset, context);
+        if (fold.length && next != current) {
+            bitset_vector_rollup_flush(result, current, &fold, scratch);
+        }
+        current = next;
+        bitset_vector_fold_add(&fold, bitset, type);
+    }
+    if (fold.length) {
+        bitset_vector_rollup_flush(result, current, &fold, scratch);
+    }
+    bitset_vector_fold_free(&fold);
+    bitset_free(scratch);
+}
+
+typedef struct bitset_vector_rollup_s {
+    const bitset_vector_t *vector;
+    unsigned (*bucket_fn)(unsigned, void *);
+    void *context;
     enum bitset_operation_type type;
+    bitset_vector_t **results;
+    unsigned *splits;
+} bitset_vector_rollup_t;
 
-    //Recursively flatten nested operations
-    for (size_t i = 0; i < operation->length; i++) {
-        if (operation->steps[i]->is_operation) {
-            vector = bitset_vector_operation_exec(operation->steps[i]->data.operation);
-            bitset_vector_operation_free(operation->steps[i]->data.operation);
-            operation->steps[i]->data.vector = vector;
-            operation->steps[i]->is_operation = false;
+static void bitset_vector_rollup_range(void *context, size_t task) {
+    bitset_vector_rollup_t *rollup = (bitset_vector_rollup_t *) context;
+    bitset_vector_t *view = bitset_vector_view(rollup->vector, rollup->splits[task], rollup->splits[task + 1]);
+    rollup->results[task] = bitset_vector_new();
+    bitset_vector_rollup_into(rollup->results[task], view, rollup->bucket_fn, rollup->context, rollup->type);
+    bitset_vector_free(view);
+}
+
+static unsigned bitset_vector_rollup_width(unsigned offset, void *context) {
+    unsigned width = *(unsigned *) context;
+    return offset - offset % width;
+}
+
+bitset_vector_t *bitset_vector_rollup(const bitset_vector_t *vector, unsigned width,
+        enum bitset_operation_type type) {
+    if (!width) {
+        BITSET_FATAL("rollup width must be non-zero");
+    }
+    return bitset_vector_rollup_fn(vector, bitset_vector_rollup_width, &width, type, 1);
+}
+
+bitset_vector_t *bitset_vector_rollup_fn(const bitset_vector_t *vector,
+        unsigned (*bucket_fn)(unsigned, void *), void *context,
+        enum bitset_operation_type type, unsigned threads) {
+    bitset_vector_t *result;
+    bitset_vector_rollup_t rollup;
+    bitset_t *bitset;
+    size_t tasks = 1, split = 1, index = 0;
+    unsigned offset, bucket, previous = 0;
+
+    if (threads > 1) {
+        tasks = BITSET_MIN(threads, vector->count);
+    }
+
+    if (tasks <= 1) {
+        result = bitset_vector_new();
+        bitset_vector_rollup_into(result, vector, bucket_fn, context, type);
+        return result;
+    }
+
+    //Split the vector into ranges of roughly equal size that start on a
+    //bucket boundary, then roll up each range independently
+    rollup.vector = vector;
+    rollup.bucket_fn = bucket_fn;
+    rollup.context = context;
+    rollup.type = type;
+    rollup.results = bitset_malloc(sizeof(bitset_vector_t *) * tasks);
+    rollup.splits = bitset_malloc(sizeof(unsigned) * (tasks + 1));
+    if (!rollup.results || !rollup.splits) {
+        bitset_oom();
+    }
+    rollup.splits[0] = BITSET_VECTOR_START;
+    BITSET_VECTOR_FOREACH(vector, bitset, offset) {
+        bucket = bucket_fn(offset, context);
+        if (split < tasks && index >= split * vector->count / tasks && bucket != previous) {
+            rollup.splits[split++] = offset;
+        }
+        previous = bucket;
+        index++;
+    }
+    tasks = split;
+    rollup.splits[tasks] = BITSET_VECTOR_END;
+    bitset_vector_parallel(tasks, threads, bitset_vector_rollup_range, &rollup);
+
+    result = rollup.results[0];
+    for (size_t i = 1; i < tasks; i++) {
+        bitset_vector_concat_slice(result, rollup.results[i], 0, BITSET_VECTOR_START, BITSET_VECTOR_END);
+        bitset_vector_free(rollup.results[i]);
+    }
+    bitset_malloc_free(rollup.results);
+    bitset_malloc_free(rollup.splits);
+
+    return result;
+}
+
+static inline bitset_offset bitset_vector_mask_intersect_count(const bitset_vector_mask_t *a,
+        const bitset_vector_mask_t *b) {
+    bitset_offset count = 0;
+    size_t position = 0;
+    if (a->length > b->length) {
+        const bitset_vector_mask_t *tmp = a;
+        a = b;
+        b = tmp;
+    }
+    for (size_t i = 0; i < a->length && position < b->length; i++) {
+        if (b->offsets[position] < a->offsets[i]) {
+            position = bitset_vector_mask_gallop(b, position, a->offsets[i]);
+        }
+        if (position < b->length && b->offsets[position] == a->offsets[i]) {
+            count += bitset_vector_popcount64(a->words[i] & b->words[position]);
         }
     }
+    return count;
+}
+
+/**
+ * Each retention task walks a contiguous range of rows. Bitsets are decoded
+ * as the window of lags ahead of the current row reaches them and freed once
+ * the row they start has been counted, so a task never holds more than
+ * max_lag + 1 decoded bitsets.
+ */
 
-    //Prepare the result vector
-    result = bitset_vector_new();
+typedef struct bitset_vector_retention_s {
+    const bitset_vector_t *vector;
+    char **starts;
+    unsigned *previous;
+    size_t *rows;
+    size_t window;
+    unsigned max_lag;
+    bitset_offset *matrix;
+} bitset_vector_retention_t;
 
-    //Prepare hash buckets
-    buckets = operation->max - operation->min + 1;
-    bucket = bitset_calloc(1, sizeof(void*) * buckets);
-    if (!bucket) {
+static void bitset_vector_retention_range(void *context, size_t task) {
+    bitset_vector_retention_t *retention = (bitset_vector_retention_t *) context;
+    const bitset_vector_t *vector = retention->vector;
+    char *ahead = retention->starts[task], *end = vector->buffer + vector->length;
+    unsigned ahead_offset = retention->previous[task], lag;
+    size_t window = retention->window, head = 0, length = 0, slot;
+    bitset_offset *counts;
+    bitset_t bitset;
+    bitset_vector_mask_t *decoded = bitset_malloc(sizeof(bitset_vector_mask_t) * window);
+    unsigned *offsets = bitset_malloc(sizeof(unsigned) * window);
+    if (!decoded || !offsets) {
         bitset_oom();
     }
+    for (size_t row = retention->rows[task]; row < retention->rows[task + 1]; row++) {
+        while (ahead < end && length < window && (!length ||
+                ahead_offset + bitset_encoded_length(ahead) - offsets[head] <= retention->max_lag)) {
+            ahead = bitset_vector_advance(ahead, &bitset, &ahead_offset);
+            slot = (head + length++) % window;
+            bitset_vector_mask_init(&decoded[slot], &bitset);
+            offsets[slot] = ahead_offset;
+        }
+        counts = retention->matrix + row * (retention->max_lag + 1);
+        for (size_t i = 0; i < length; i++) {
+            slot = (head + i) % window;
+            lag = offsets[slot] - offsets[head];
+            counts[lag] = bitset_vector_mask_intersect_count(&decoded[head], &decoded[slot]);
+        }
+        bitset_vector_mask_free(&decoded[head]);
+        head = (head + 1) % window;
+        length--;
+    }
+    for (size_t i = 0; i < length; i++) {
+        bitset_vector_mask_free(&decoded[(head + i) % window]);
+    }
+    bitset_malloc_free(decoded);
+    bitset_malloc_free(offsets);
+}
+
+void bitset_vector_retention(const bitset_vector_t *vector, unsigned max_lag,
+        bitset_offset *matrix, unsigned threads) {
+    bitset_vector_retention_t retention;
+    char *buffer = vector->buffer;
+    unsigned offset = vector->base_offset;
+    size_t tasks = threads ? threads : 1, task = 0;
+    bitset_t bitset;
 
-    //OR the first vector
-    vector = operation->steps[0]->data.vector;
+    memset(matrix, 0, sizeof(bitset_offset) * vector->count * (max_lag + 1));
+    if (!vector->count) {
+        return;
+    }
+    if (tasks > vector->count) {
+        tasks = vector->count;
+    }
 
-    buffer = vector->buffer;
-    offset = 0;
-    while (buffer < vector->buffer + vector->length) {
-        next = bitset_vector_advance(buffer, &bitset, &offset);
-        assert(offset >= operation->min && offset <= operation->max);
-        bucket[offset - operation->min] = buffer + bitset_encoded_length_size(buffer);
-        buffer = next;
+    //Split the rows into a contiguous range per task, noting where each
+    //range starts in the buffer
+    retention.starts = bitset_malloc(sizeof(char *) * tasks);
+    retention.previous = bitset_malloc(sizeof(unsigned) * tasks);
+    retention.rows = bitset_malloc(sizeof(size_t) * (tasks + 1));
+    if (!retention.starts || !retention.previous || !retention.rows) {
+        bitset_oom();
+    }
+    for (size_t row = 0; task < tasks; row++) {
+        if (row == task * vector->count / tasks) {
+            retention.starts[task] = buffer;
+            retention.previous[task] = offset;
+            retention.rows[task++] = row;
+        }
+        buffer = bitset_vector_advance(buffer, &bitset, &offset);
     }
+    retention.rows[tasks] = vector->count;
+    retention.vector = vector;
+    retention.window = (size_t) max_lag + 1 < vector->count ? (size_t) max_lag + 1 : vector->count;
+    retention.max_lag = max_lag;
+    retention.matrix = matrix;
+
+    bitset_vector_parallel(tasks, threads, bitset_vector_retention_range, &retention);
+
+    bitset_malloc_free(retention.starts);
+    bitset_malloc_free(retention.previous);
+    bitset_malloc_free(retention.rows);
+}
 
-    for (size_t i = 1; i < operation->length; i++) {
+/**
+ * A funnel window holds the bitsets that reached a step in the last window
+ * offsets. Bitsets are pushed onto the back, whose union is kept as it grows,
+ * and evicted from the front, where each bitset keeps the union of itself
+ * and the front bitsets after it. When the front empties the back becomes
+ * the new front, so the union of the window is always the union of two
+ * bitsets and each bitset is folded into a union a fixed number of times.
+ */
 
-        type = operation->steps[i]->type;
-        vector = operation->steps[i]->data.vector;
+typedef struct bitset_funnel_window_s {
+    unsigned *offsets;
+    bitset_t **bitsets;
+    bitset_t **suffixes;
+    bitset_t *back;
+    size_t start;
+    size_t split;
+    size_t length;
+    size_t size;
+} bitset_funnel_window_t;
 
-        if (type == BITSET_AND) {
+static inline void bitset_funnel_or(bitset_vector_fold_t *fold, const bitset_t *a, const bitset_t *b,
+        bitset_t *result) {
+    bitset_vector_fold_add(fold, a, BITSET_OR);
+    bitset_vector_fold_add(fold, b, BITSET_OR);
+    bitset_vector_fold_exec(fold, result);
+}
 
-            and_bucket = bitset_calloc(1, sizeof(void*) * buckets);
-            if (!and_bucket) {
+static inline void bitset_funnel_window_push(bitset_funnel_window_t *window, unsigned offset, bitset_t *bitset,
+        bitset_vector_fold_t *fold, bitset_t **swap) {
+    bitset_t *previous;
+    if (window->length == window->size) {
+        if (window->start) {
+            memmove(window->offsets, window->offsets + window->start, sizeof(unsigned) * (window->length - window->start));
+            memmove(window->bitsets, window->bitsets + window->start, sizeof(bitset_t *) * (window->length - window->start));
+            memmove(window->suffixes, window->suffixes + window->start, sizeof(bitset_t *) * (window->split - window->start));
+            window->length -= window->start;
+            window->split -= window->start;
+            window->start = 0;
+        } else {
+            window->size = window->size ? window->size * 2 : 8;
+            window->offsets = bitset_realloc(window->offsets, sizeof(unsigned) * window->size);
+            window->bitsets = bitset_realloc(window->bitsets, sizeof(bitset_t *) * window->size);
+            window->suffixes = bitset_realloc(window->suffixes, sizeof(bitset_t *) * window->size);
+            if (!window->offsets || !window->bitsets || !window->suffixes) {
                 bitset_oom();
             }
-            if (vector) {
-                buffer = vector->buffer;
-                offset = 0;
-                while (buffer < vector->buffer + vector->length) {
-                    next = bitset_vector_advance(buffer, &bitset, &offset);
-                    assert(offset >= operation->min && offset <= operation->max);
-                    key = offset - operation->min;
-                    if (bucket[key]) {
-                        if (BITSET_IS_TAGGED_POINTER(bucket[key])) {
-                            nested = (bitset_operation_t *) BITSET_UNTAG_POINTER(bucket[key]);
-                        } else {
-                            bitset_buffer = bucket[key];
-                            bitset_length = bitset_encoded_length(bitset_buffer);
-                            bitset_buffer += bitset_encoded_length_size(bitset_buffer);
-                            nested = bitset_operation_new(NULL);
-                            bitset_operation_add_buffer(nested, (bitset_word*)bitset_buffer, bitset_length, BITSET_OR);
-                        }
-                        bitset_operation_add_buffer(nested, bitset.buffer, bitset.length, BITSET_AND);
-                        and_bucket[key] = (void *) BITSET_TAG_POINTER(nested);
-                    }
-                    buffer = next;
-                }
-            }
-            for (size_t j = 0; j < buckets; j++) {
-                if (and_bucket[j] && BITSET_IS_TAGGED_POINTER(bucket[j])) {
-                    nested = (bitset_operation_t *) BITSET_UNTAG_POINTER(bucket[j]);
-                    bitset_operation_free(nested);
+        }
+    }
+    window->offsets[window->length] = offset;
+    window->bitsets[window->length++] = bitset;
+    bitset_funnel_or(fold, window->back, bitset, *swap);
+    previous = window->back;
+    window->back = *swap;
+    *swap = previous;
+}
+
+static inline void bitset_funnel_window_evict(bitset_funnel_window_t *window, unsigned offset, unsigned width,
+        bitset_vector_fold_t *fold) {
+    while (window->start < window->length && offset - window->offsets[window->start] > width) {
+        if (window->start == window->split) {
+            for (size_t i = window->length; i-- > window->start;) {
+                if (i + 1 < window->length) {
+                    window->suffixes[i] = bitset_new();
+                    bitset_funnel_or(fold, window->bitsets[i], window->suffixes[i + 1], window->suffixes[i]);
+                } else {
+                    window->suffixes[i] = bitset_copy(window->bitsets[i]);
                 }
             }
-            bitset_malloc_free(bucket);
-            bucket = and_bucket;
+            window->split = window->length;
+            window->back->length = 0;
+        }
+        bitset_free(window->bitsets[window->start]);
+        bitset_free(window->suffixes[window->start++]);
+    }
+}
 
-        } else {
+bitset_t *bitset_funnel_exec(bitset_vector_t **vectors, size_t steps, unsigned window, bitset_offset *counts) {
+    bitset_vector_cursor_t *cursors, *cursor, **heap;
+    bitset_funnel_window_t *windows, *previous_window;
+    bitset_vector_fold_t fold = { NULL, NULL, NULL, NULL, NULL, 0, 0 };
+    bitset_t **reached, *bitset, *swap, *previous;
+    size_t heap_length = 0, step;
+    unsigned offset;
 
-            buffer = vector->buffer;
-            offset = 0;
-            while (buffer < vector->buffer + vector->length) {
-                next = bitset_vector_advance(buffer, &bitset, &offset);
-                assert(offset >= operation->min && offset <= operation->max);
-                key = offset - operation->min;
-                if (BITSET_IS_TAGGED_POINTER(bucket[key])) {
-                    nested = (bitset_operation_t *) BITSET_UNTAG_POINTER(bucket[key]);
-                    bitset_operation_add_buffer(nested, bitset.buffer, bitset.length, type);
-                } else if (bucket[key]) {
-                    bitset_buffer = bucket[key];
-                    bitset_length = bitset_encoded_length(bitset_buffer);
-                    bitset_buffer += bitset_encoded_length_size(bitset_buffer);
-                    nested = bitset_operation_new(NULL);
-                    bitset_operation_add_buffer(nested, (bitset_word*)bitset_buffer, bitset_length, BITSET_OR);
-                    bucket[key] = (void *) BITSET_TAG_POINTER(nested);
-                    bitset_operation_add_buffer(nested, bitset.buffer, bitset.length, type);
-                } else {
-                    bucket[key] = buffer + bitset_encoded_length_size(buffer);
+    if (!steps) {
+        return bitset_new();
+    }
+    cursors = bitset_malloc(sizeof(bitset_vector_cursor_t) * steps);
+    heap = bitset_malloc(sizeof(bitset_vector_cursor_t *) * steps);
+    windows = bitset_calloc(1, sizeof(bitset_funnel_window_t) * steps);
+    reached = bitset_malloc(sizeof(bitset_t *) * steps);
+    if (!cursors || !heap || !windows || !reached) {
+        bitset_oom();
+    }
+    for (size_t i = 0; i < steps; i++) {
+        reached[i] = bitset_new();
+        windows[i].back = bitset_new();
+        bitset_vector_cursor_init(&cursors[i], vectors[i], i, 0, BITSET_VECTOR_START);
+        if (bitset_vector_cursor_next(&cursors[i])) {
+            bitset_vector_heap_push(heap, &heap_length, &cursors[i]);
+        }
+    }
+    swap = bitset_new();
+
+    //Walk every vector in offset order. Steps at the same offset are popped
+    //in order, so a bit can move through several steps at one offset. A bit
+    //reaches a step when it's in the step's bitset and reached the previous
+    //step no more than window offsets before. Bitsets are combined with a
+    //streaming word merge, and each window keeps its union up to date as
+    //offsets enter and leave it
+    while (heap_length) {
+        offset = heap[0]->offset;
+        while (heap_length && heap[0]->offset == offset) {
+            cursor = bitset_vector_heap_pop(heap, &heap_length);
+            step = cursor->step;
+            previous_window = step ? &windows[step - 1] : NULL;
+            if (previous_window) {
+                bitset_funnel_window_evict(previous_window, offset, window, &fold);
+            }
+            if (!step) {
+                bitset = bitset_copy(&cursor->bitset);
+            } else if (previous_window->start < previous_window->length) {
+                if (previous_window->start < previous_window->split) {
+                    bitset_vector_fold_add(&fold, previous_window->suffixes[previous_window->start], BITSET_OR);
                 }
-                buffer = next;
+                bitset_vector_fold_add(&fold, previous_window->back, BITSET_OR);
+                bitset_vector_fold_add(&fold, &cursor->bitset, BITSET_AND);
+                bitset = bitset_new();
+                bitset_vector_fold_exec(&fold, bitset);
+            } else {
+                bitset = NULL;
+            }
+            if (bitset && bitset->length) {
+                bitset_funnel_or(&fold, reached[step], bitset, swap);
+                previous = reached[step];
+                reached[step] = swap;
+                swap = previous;
+                if (step + 1 < steps) {
+                    bitset_funnel_window_evict(&windows[step], offset, window, &fold);
+                    bitset_funnel_window_push(&windows[step], offset, bitset, &fold, &swap);
+                    bitset = NULL;
+                }
+            }
+            if (bitset) {
+                bitset_free(bitset);
+            }
+            if (bitset_vector_cursor_next(cursor)) {
+                bitset_vector_heap_push(heap, &heap_length, cursor);
             }
         }
     }
 
-    //Prepare the result vector
-    offset = 0;
-    buffer = result->buffer;
-    for (size_t i = 0; i < buckets; i++) {
-        if (BITSET_IS_TAGGED_POINTER(bucket[i])) {
-            nested = (bitset_operation_t *) BITSET_UNTAG_POINTER(bucket[i]);
-            bitset_ptr = bitset_operation_exec(nested);
-            if (bitset_ptr->length) {
-                buffer = bitset_vector_encode(result, bitset_ptr, operation->min + i - offset);
-                offset = operation->min + i;
+    for (size_t i = 0; i < steps; i++) {
+        if (counts) {
+            counts[i] = bitset_count(reached[i]);
+        }
+        for (size_t j = windows[i].start; j < windows[i].length; j++) {
+            bitset_free(windows[i].bitsets[j]);
+            if (j < windows[i].split) {
+                bitset_free(windows[i].suffixes[j]);
             }
-            bitset_free(bitset_ptr);
-            bitset_operation_free(nested);
-        } else if (bucket[i]) {
-            offset_bytes = bitset_encoded_length_required_bytes(operation->min + i - offset);
-            bitset_length = bitset_encoded_length(bucket[i]);
-            copy_length = bitset_encoded_length_required_bytes(bitset_length) + bitset_length * sizeof(bitset_word);
-            uintptr_t buf_offset = buffer - result->buffer;
-            bitset_vector_resize(result, result->length + offset_bytes + copy_length);
-            buffer = result->buffer + buf_offset;
-            bitset_encoded_length_bytes(buffer, operation->min + i - offset);
-            buffer += offset_bytes;
-            memcpy(buffer, bucket[i], copy_length);
-            buffer += copy_length;
-            offset = operation->min + i;
+        }
+        bitset_malloc_free(windows[i].offsets);
+        bitset_malloc_free(windows[i].bitsets);
+        bitset_malloc_free(windows[i].suffixes);
+        bitset_free(windows[i].back);
+        if (i + 1 < steps) {
+            bitset_free(reached[i]);
         }
     }
-
-    bitset_malloc_free(bucket);
-
-    return result;
+    bitset = reached[steps - 1];
+    bitset_vector_fold_free(&fold);
+    bitset_free(swap);
+    bitset_malloc_free(cursors);
+    bitset_malloc_free(heap);
+    bitset_malloc_free(windows);
+    bitset_malloc_free(reached);
+    return bitset;
 }
-
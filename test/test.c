@@ -1,4 +1,5 @@
 #include <stdlib.h>
+#include <limits.h>
 #include <stdio.h>
 #include <time.h>
 #include <string.h>
@@ -68,6 +69,8 @@ int main(int argc, char **argv) {
     test_suite_count();
     printf("Testing operations\n");
     test_suite_operation();
+    printf("Testing predicates\n");
+    test_suite_predicate();
     printf("Testing min / max\n");
     test_suite_min();
     test_suite_max();
@@ -325,6 +328,42 @@ void test_suite_set() {
     test_bitset("Testing setting position bit 4", b, 1, e11);
     bitset_free(b);
 
+    uint32_t p12[] = { BITSET_CREATE_FILL(1, 0), BITSET_CREATE_FILL(1, 0) };
+    b = bitset_new_buffer((const char *)p12, 8);
+    test_bool("Testing unsetting position bit 1\n", true, bitset_set_to(b, 31, false));
+    uint32_t e12[] = { BITSET_CREATE_EMPTY_FILL(2), BITSET_CREATE_FILL(1, 0) };
+    test_bitset("Testing unsetting position bit 2", b, 2, e12);
+    test_bool("Testing unsetting position bit 3\n", true, bitset_get(b, 93));
+    test_bool("Testing unset in fill 1\n", false, bitset_set_to(b, 10, false));
+    test_bool("Testing unset in fill 2\n", false, bitset_set_to(b, 70, false));
+    test_bitset("Testing unset in fill 3", b, 2, e12);
+    bitset_free(b);
+
+    bitset_offset full = (bitset_offset) BITSET_MAX_LENGTH * BITSET_LITERAL_LENGTH;
+    uint32_t p13[] = { BITSET_CREATE_FILL(BITSET_MAX_LENGTH, 0), BITSET_CREATE_FILL(4, 2) };
+    b = bitset_new_buffer((const char *)p13, 8);
+    test_bool("Testing unsetting position bit of a full fill 1\n", true, bitset_set_to(b, full, false));
+    uint32_t e13[] = { BITSET_CREATE_EMPTY_FILL(BITSET_MAX_LENGTH), BITSET_CREATE_FILL(5, 2) };
+    test_bitset("Testing unsetting position bit of a full fill 2", b, 2, e13);
+    bitset_free(b);
+
+    uint32_t p14[] = { BITSET_CREATE_FILL(BITSET_MAX_LENGTH, 0), BITSET_CREATE_LITERAL(3) };
+    b = bitset_new_buffer((const char *)p14, 8);
+    test_bool("Testing unsetting position bit of a full fill 3\n", true, bitset_set_to(b, full, false));
+    uint32_t e14[] = { BITSET_CREATE_EMPTY_FILL(BITSET_MAX_LENGTH), BITSET_CREATE_FILL(1, 3) };
+    test_bitset("Testing unsetting position bit of a full fill 4", b, 2, e14);
+    test_bool("Testing unsetting position bit of a full fill 5\n", true, bitset_get(b, full + BITSET_LITERAL_LENGTH + 3));
+    bitset_free(b);
+
+    uint32_t p15[] = { BITSET_CREATE_FILL(BITSET_MAX_LENGTH, 0), BITSET_CREATE_LITERAL(3) | BITSET_CREATE_LITERAL(4) };
+    b = bitset_new_buffer((const char *)p15, 8);
+    test_bool("Testing unsetting position bit of a full fill 6\n", true, bitset_set_to(b, full, false));
+    uint32_t e15[] = { BITSET_CREATE_EMPTY_FILL(BITSET_MAX_LENGTH), BITSET_CREATE_EMPTY_FILL(1),
+        BITSET_CREATE_LITERAL(3) | BITSET_CREATE_LITERAL(4) };
+    test_bitset("Testing unsetting position bit of a full fill 7", b, 3, e15);
+    test_ulong("Testing unsetting position bit of a full fill 8\n", 2, bitset_count(b));
+    bitset_free(b);
+
     b = bitset_new();
     test_bool("Testing random set/get 1\n", false, bitset_set_to(b, 0, true));
     test_bool("Testing random set/get 1\n", false, bitset_set_to(b, 36, true));
@@ -807,6 +846,163 @@ void test_suite_operation() {
     bitset_free(b3);
     bitset_free(b4);
 
+    BITSET_NEW(s1, 100, 200, 300, 10000);
+    BITSET_NEW(s2, 100, 300, 5000);
+    BITSET_NEW(s3, 200, 5000, 20000);
+    bitset_operation_t *batch[3];
+    bitset_t *batch_results[3];
+    bitset_offset batch_counts[3];
+    for (size_t i = 0; i < 2; i++) {
+        batch[0] = bitset_operation_new(s1);
+        bitset_operation_add(batch[0], s2, BITSET_AND);
+        batch[1] = bitset_operation_new(s2);
+        bitset_operation_add(batch[1], s3, BITSET_OR);
+        bitset_operation_add(batch[1], s1, BITSET_ANDNOT);
+        batch[2] = bitset_operation_new(s3);
+        op2 = bitset_operation_new(s1);
+        bitset_operation_add(op2, s2, BITSET_XOR);
+        bitset_operation_add_nested(batch[2], op2, BITSET_OR);
+        if (i == 0) {
+            bitset_operation_exec_batch(batch, 3, batch_results);
+        } else {
+            bitset_operation_count_batch(batch, 3, batch_counts);
+        }
+        for (size_t j = 0; j < 3; j++) {
+            bitset_operation_free(batch[j]);
+        }
+    }
+    test_int("Checking batch operation count 1\n", 2, bitset_count(batch_results[0]));
+    test_bool("Checking batch operation get 1\n", true, bitset_get(batch_results[0], 100));
+    test_bool("Checking batch operation get 2\n", true, bitset_get(batch_results[0], 300));
+    test_int("Checking batch operation count 2\n", 2, bitset_count(batch_results[1]));
+    test_bool("Checking batch operation get 3\n", true, bitset_get(batch_results[1], 5000));
+    test_bool("Checking batch operation get 4\n", true, bitset_get(batch_results[1], 20000));
+    test_int("Checking batch operation count 3\n", 4, bitset_count(batch_results[2]));
+    test_bool("Checking batch operation get 5\n", false, bitset_get(batch_results[2], 100));
+    test_bool("Checking batch operation get 6\n", true, bitset_get(batch_results[2], 10000));
+    test_ulong("Checking batch operation counts 1\n", 2, batch_counts[0]);
+    test_ulong("Checking batch operation counts 2\n", 2, batch_counts[1]);
+    test_ulong("Checking batch operation counts 3\n", 4, batch_counts[2]);
+    for (size_t j = 0; j < 3; j++) {
+        bitset_free(batch_results[j]);
+    }
+
+    b4 = bitset_new();
+    ops = bitset_operation_new(s1);
+    bitset_operation_add(ops, s3, BITSET_OR);
+    bitset_operation_exec_into(ops, b4);
+    bitset_operation_free(ops);
+    test_int("Checking operation exec into count 1\n", 6, bitset_count(b4));
+    test_bool("Checking operation exec into get 1\n", true, bitset_get(b4, 20000));
+    bitset_word *into_buffer = b4->buffer;
+    size_t into_size = b4->size;
+    ops = bitset_operation_new(s1);
+    bitset_operation_add(ops, s2, BITSET_AND);
+    bitset_operation_exec_into(ops, b4);
+    bitset_operation_free(ops);
+    test_int("Checking operation exec into count 2\n", 2, bitset_count(b4));
+    test_bool("Checking operation exec into get 2\n", false, bitset_get(b4, 20000));
+    test_bool("Checking operation exec into reuses the buffer\n", true, into_buffer == b4->buffer);
+    test_ulong("Checking operation exec into keeps capacity\n", into_size, b4->size);
+    ops = bitset_operation_new(s2);
+    bitset_operation_exec_into(ops, b4);
+    bitset_operation_free(ops);
+    test_int("Checking operation exec into count 3\n", 3, bitset_count(b4));
+    bitset_shrink(b4);
+    test_bool("Checking bitset shrink 1\n", true, b4->size < into_size);
+    test_int("Checking bitset shrink 2\n", 3, bitset_count(b4));
+    bitset_clear(b4);
+    bitset_shrink(b4);
+    test_ulong("Checking bitset shrink 3\n", 0, b4->size);
+    bitset_free(b4);
+    ops = bitset_operation_new(s1);
+    bitset_operation_add(ops, s3, BITSET_OR);
+    b4 = bitset_operation_exec(ops);
+    bitset_operation_free(ops);
+    test_bool("Checking operation exec isn't over-allocated\n", true, b4->size < b4->length * 2);
+    bitset_free(b4);
+    b4 = bitset_new();
+    bitset_set(b4, 0);
+    bitset_set(b4, (bitset_offset) BITSET_MAX_LENGTH * 2 * BITSET_LITERAL_LENGTH);
+    ops = bitset_operation_new(b4);
+    bitset_t *gap = bitset_new();
+    bitset_set(gap, 1);
+    bitset_operation_add(ops, gap, BITSET_OR);
+    bitset_t *gap_result = bitset_operation_exec(ops);
+    bitset_operation_free(ops);
+    test_int("Checking operation fill gap count\n", 3, bitset_count(gap_result));
+    test_bool("Checking operation fill gap get\n", true,
+        bitset_get(gap_result, (bitset_offset) BITSET_MAX_LENGTH * 2 * BITSET_LITERAL_LENGTH));
+    bitset_free(gap_result);
+    bitset_free(gap);
+    bitset_free(b4);
+
+    ops = bitset_operation_new(s3);
+    op2 = bitset_operation_new(s1);
+    bitset_operation_add(op2, s2, BITSET_AND);
+    bitset_operation_add_nested(ops, op2, BITSET_OR);
+    bitset_operation_count(ops);
+    bitset_operation_free(ops);
+    test_bool("Checking operands aren't versioned without a cache\n", true, !s1->version && !s2->version);
+
+    bitset_operation_cache_t *cache = bitset_operation_cache_new(4096);
+    for (size_t i = 0; i < 3; i++) {
+        ops = bitset_operation_new(s3);
+        bitset_operation_set_cache(ops, cache);
+        op2 = bitset_operation_new(s1);
+        bitset_operation_add(op2, s2, BITSET_AND);
+        bitset_operation_add_nested(ops, op2, BITSET_OR);
+        b4 = bitset_operation_exec(ops);
+        test_int("Checking cached nested operation count\n", 5, bitset_count(b4));
+        test_bool("Checking cached nested operation get 1\n", true, bitset_get(b4, 100));
+        test_bool("Checking cached nested operation get 2\n", true, bitset_get(b4, 20000));
+        bitset_operation_free(ops);
+        bitset_free(b4);
+    }
+    test_int("Checking nested operation cache misses\n", 1, cache->misses);
+    test_int("Checking nested operation cache hits\n", 2, cache->hits);
+    test_int("Checking nested operation cache count\n", 1, cache->count);
+    test_bool("Checking cached operands are versioned\n", true, s1->version && s2->version);
+    bitset_set(s2, 200);
+    ops = bitset_operation_new(s3);
+    bitset_operation_set_cache(ops, cache);
+    op2 = bitset_operation_new(s1);
+    bitset_operation_add(op2, s2, BITSET_AND);
+    bitset_operation_add_nested(ops, op2, BITSET_OR);
+    test_ulong("Checking modified operands aren't served from the cache\n", 5, bitset_operation_count(ops));
+    test_int("Checking nested operation cache misses 2\n", 2, cache->misses);
+    bitset_operation_free(ops);
+    bitset_unset(s2, 200);
+    ops = bitset_operation_new(s3);
+    bitset_operation_set_cache(ops, cache);
+    op2 = bitset_operation_new(s1);
+    bitset_operation_add_buffer(op2, s2->buffer, s2->length, BITSET_AND);
+    bitset_operation_add_nested(ops, op2, BITSET_OR);
+    test_ulong("Checking unversioned operands bypass the cache 1\n", 5, bitset_operation_count(ops));
+    test_int("Checking unversioned operands bypass the cache 2\n", 2, cache->misses);
+    test_int("Checking unversioned operands bypass the cache 3\n", 2, cache->count);
+    bitset_operation_free(ops);
+    bitset_operation_cache_free(cache);
+
+    cache = bitset_operation_cache_new(sizeof(bitset_operation_cache_entry_t) + 16
+        + 7 * sizeof(uint64_t));
+    for (size_t i = 0; i < 2; i++) {
+        ops = bitset_operation_new(s3);
+        bitset_operation_set_cache(ops, cache);
+        op2 = bitset_operation_new(i ? s2 : s1);
+        bitset_operation_add(op2, s3, BITSET_AND);
+        bitset_operation_add_nested(ops, op2, BITSET_OR);
+        bitset_operation_count(ops);
+        bitset_operation_free(ops);
+    }
+    test_int("Checking nested operation cache eviction 1\n", 1, cache->count);
+    test_bool("Checking nested operation cache eviction 2\n", true, cache->bytes <= cache->max_bytes);
+    bitset_operation_cache_free(cache);
+
+    bitset_free(s1);
+    bitset_free(s2);
+    bitset_free(s3);
+
 #ifdef BITSET_64BIT_OFFSETS
     b1 = bitset_new();
     b2 = bitset_new();
@@ -827,9 +1023,129 @@ void test_suite_operation() {
 #endif
 }
 
+void test_suite_predicate() {
+    BITSET_NEW(b1, 10, 100, 1000, 100000);
+    BITSET_NEW(b2, 100, 1000);
+    BITSET_NEW(b3, 20, 2000, 200000);
+    BITSET_NEW(b4, 10, 100, 1000, 100000);
+    bitset_t *empty = bitset_new();
+
+    test_bool("Checking intersects 1\n", true, bitset_intersects(b1, b2));
+    test_bool("Checking intersects 2\n", true, bitset_intersects(b2, b1));
+    test_bool("Checking intersects 3\n", false, bitset_intersects(b1, b3));
+    test_bool("Checking intersects 4\n", false, bitset_intersects(b1, empty));
+
+    test_bool("Checking is subset 1\n", true, bitset_is_subset(b2, b1));
+    test_bool("Checking is subset 2\n", false, bitset_is_subset(b1, b2));
+    test_bool("Checking is subset 3\n", false, bitset_is_subset(b3, b1));
+    test_bool("Checking is subset 4\n", true, bitset_is_subset(empty, b1));
+    test_bool("Checking is subset 5\n", true, bitset_is_subset(b1, b4));
+
+    test_bool("Checking equals 1\n", true, bitset_equals(b1, b4));
+    test_bool("Checking equals 2\n", false, bitset_equals(b1, b2));
+    test_bool("Checking equals 3\n", true, bitset_equals(empty, empty));
+    test_bool("Checking equals 4\n", false, bitset_equals(b2, empty));
+
+    uint32_t p1[] = { BITSET_CREATE_FILL(3, 4) };
+    uint32_t p2[] = { BITSET_CREATE_EMPTY_FILL(3), BITSET_CREATE_LITERAL(4) };
+    bitset_t *e1 = bitset_new_buffer((const char *)p1, 4);
+    bitset_t *e2 = bitset_new_buffer((const char *)p2, 8);
+    test_bool("Checking equals with different encodings\n", true, bitset_equals(e1, e2));
+    test_bool("Checking subset with different encodings\n", true, bitset_is_subset(e2, e1));
+    bitset_free(e1);
+    bitset_free(e2);
+
+    bitset_operation_t *ops = bitset_operation_new(b1);
+    bitset_operation_add(ops, b3, BITSET_OR);
+    test_bool("Checking count at least 1\n", true, bitset_operation_count_at_least(ops, 7));
+    bitset_operation_free(ops);
+    ops = bitset_operation_new(b1);
+    bitset_operation_add(ops, b3, BITSET_OR);
+    test_bool("Checking count at least 2\n", false, bitset_operation_count_at_least(ops, 8));
+    bitset_operation_free(ops);
+    ops = bitset_operation_new(b1);
+    bitset_operation_add(ops, b2, BITSET_AND);
+    bitset_operation_add(ops, b3, BITSET_OR);
+    bitset_operation_add(ops, b4, BITSET_ANDNOT);
+    test_bool("Checking count at least 3\n", true, bitset_operation_count_at_least(ops, 3));
+    bitset_operation_free(ops);
+    ops = bitset_operation_new(b1);
+    bitset_operation_add(ops, b2, BITSET_AND);
+    bitset_operation_add(ops, b3, BITSET_OR);
+    bitset_operation_add(ops, b4, BITSET_ANDNOT);
+    test_bool("Checking count at least 4\n", false, bitset_operation_count_at_least(ops, 4));
+    bitset_operation_free(ops);
+    ops = bitset_operation_new(b1);
+    bitset_operation_add(ops, b2, BITSET_XOR);
+    test_bool("Checking count at least 5\n", true, bitset_operation_count_at_least(ops, 2));
+    bitset_operation_free(ops);
+    ops = bitset_operation_new(b1);
+    bitset_operation_add(ops, b2, BITSET_XOR);
+    test_bool("Checking count at least 6\n", false, bitset_operation_count_at_least(ops, 3));
+    bitset_operation_free(ops);
+
+    bitset_iterator_t *range;
+    bitset_offset range_offset;
+    unsigned range_count;
+    ops = bitset_operation_new(b1);
+    bitset_operation_add(ops, b3, BITSET_OR);
+    range = bitset_operation_exec_range(ops, 100, 3);
+    bitset_operation_free(ops);
+    test_int("Checking operation range length 1\n", 3, range->length);
+    range_count = 0;
+    BITSET_FOREACH(range, range_offset) {
+        test_bool("Checking operation range offsets 1\n", true, range_offset == (range_count == 0 ? 100 :
+            range_count == 1 ? 1000 : 2000));
+        range_count++;
+    }
+    bitset_iterator_free(range);
+    ops = bitset_operation_new(b1);
+    bitset_operation_add(ops, b3, BITSET_OR);
+    range = bitset_operation_exec_range_desc(ops, 150000, 10);
+    bitset_operation_free(ops);
+    test_int("Checking operation range length 2\n", 6, range->length);
+    test_ulong("Checking operation range offsets 2\n", 100000, range->offsets[0]);
+    test_ulong("Checking operation range offsets 3\n", 10, range->offsets[5]);
+    bitset_iterator_free(range);
+    ops = bitset_operation_new(b1);
+    bitset_operation_add(ops, b2, BITSET_AND);
+    range = bitset_operation_exec_range(ops, 1001, 10);
+    bitset_operation_free(ops);
+    test_int("Checking operation range length 3\n", 0, range->length);
+    bitset_iterator_free(range);
+
+    bitset_free(b1);
+    bitset_free(b2);
+    bitset_free(b3);
+    bitset_free(b4);
+    bitset_free(empty);
+}
+
+static unsigned test_month_bucket(unsigned offset, void *context) {
+    return offset / 30 * 30;
+}
+
+static void test_trailer_checksum(char *buffer, size_t length) {
+    char *trailer = buffer + length;
+    size_t last = ((unsigned char)trailer[22] << 8) | (unsigned char)trailer[23];
+    uint32_t hash = 2166136261U;
+    for (size_t i = 0; i < 36; i++) {
+        hash = (hash ^ (unsigned char)trailer[i]) * 16777619U;
+    }
+    for (size_t i = 0; i < ((buffer[0] & 0x80) ? 4 : 2); i++) {
+        hash = (hash ^ (unsigned char)buffer[i]) * 16777619U;
+    }
+    for (size_t i = 0; i < ((buffer[last] & 0x80) ? 4 : 2); i++) {
+        hash = (hash ^ (unsigned char)buffer[last + i]) * 16777619U;
+    }
+    for (size_t i = 0; i < 4; i++) {
+        trailer[36 + i] = (unsigned char)(hash >> ((3 - i) * 8));
+    }
+}
+
 void test_suite_vector() {
 
-    bitset_vector_t *l, *l2, *l3;
+    bitset_vector_t *l, *l2, *l3, *l4;
     bitset_t *b;
     bitset_word *tmp;
     unsigned loop_count;
@@ -979,6 +1295,455 @@ void test_suite_vector() {
     test_int("Checking tail offset\n", 200010, l3->tail_offset);
     bitset_vector_free(l3);
 
+    //Check random access with and without a directory
+    l3 = bitset_vector_new();
+    for (unsigned i = 1; i <= 100; i++) {
+        b = bitset_new();
+        bitset_set_to(b, i, true);
+        bitset_vector_push(l3, b, i * 3);
+        bitset_free(b);
+        if (i == 50) {
+            bitset_vector_build_directory(l3, 8);
+        }
+    }
+    test_int("Checking directory bitset count\n", 100, bitset_vector_bitsets(l3));
+    test_int("Checking directory samples\n", 13, l3->directory->length);
+    bitset_t view;
+    test_bool("Checking vector get 1\n", true, bitset_vector_get(l3, 3, &view));
+    test_bool("Checking vector get 2\n", true, bitset_get(&view, 1) && bitset_count(&view) == 1);
+    test_bool("Checking vector get 3\n", true, bitset_vector_get(l3, 201, &view));
+    test_bool("Checking vector get 4\n", true, bitset_get(&view, 67) && bitset_count(&view) == 1);
+    test_bool("Checking vector get 5\n", true, bitset_vector_get(l3, 300, &view));
+    test_bool("Checking vector get 6\n", true, bitset_get(&view, 100));
+    test_bool("Checking vector get 7\n", false, bitset_vector_get(l3, 202, &view));
+    test_bool("Checking vector get 8\n", false, bitset_vector_get(l3, 301, &view));
+    test_bool("Checking vector get 9\n", false, bitset_vector_get(l3, 0, &view));
+    view.size = 1024;
+    test_bool("Checking vector get borrows 1\n", true, bitset_vector_get(l3, 201, &view) && !view.size);
+    bitset_set_to(&view, 1000, true);
+    test_bool("Checking vector get borrows 2\n", true, view.size && bitset_get(&view, 67) &&
+        bitset_get(&view, 1000));
+    bitset_malloc_free(view.buffer);
+    test_bool("Checking vector get borrows 3\n", true, bitset_vector_get(l3, 201, &view) &&
+        bitset_count(&view) == 1);
+    l2 = bitset_vector_new();
+    bitset_vector_concat(l2, l3, 0, 100, 200);
+    test_int("Checking sliced bitset count\n", 33, bitset_vector_bitsets(l2));
+    test_int("Checking sliced tail offset\n", 198, l2->tail_offset);
+    test_bool("Checking sliced get\n", true, bitset_vector_get(l2, 102, &view) && bitset_get(&view, 34));
+    bitset_vector_build_directory(l2, 4);
+    bitset_vector_concat(l2, l3, 1000, 150, BITSET_VECTOR_END);
+    test_int("Checking concat bitset count\n", 84, bitset_vector_bitsets(l2));
+    test_int("Checking concat tail offset\n", 1300, l2->tail_offset);
+    test_int("Checking concat directory samples\n", 21, l2->directory->length);
+    test_bool("Checking concat get\n", true, bitset_vector_get(l2, 1201, &view) && bitset_get(&view, 67));
+    test_bool("Checking concat get 2\n", true, bitset_vector_get(l2, 198, &view) && bitset_get(&view, 66));
+    bitset_vector_free(l2);
+    l2 = bitset_vector_copy(l3);
+    test_bool("Checking copied directory get\n", true, bitset_vector_get(l2, 150, &view) && bitset_get(&view, 50));
+    bitset_vector_free(l2);
+
+    //Check views over part of the vector
+    l2 = bitset_vector_view(l3, 100, 200);
+    test_int("Checking view bitset count\n", 33, bitset_vector_bitsets(l2));
+    test_int("Checking view base offset\n", 99, l2->base_offset);
+    test_int("Checking view tail offset\n", 198, l2->tail_offset);
+    test_bool("Checking view references the buffer\n", true,
+        l2->buffer > l3->buffer && l2->buffer + l2->length < l3->buffer + l3->length);
+    loop_count = 0;
+    BITSET_VECTOR_FOREACH(l2, b, offset) {
+        test_bool("Checking view foreach\n", true, offset == 102 + loop_count * 3 &&
+            bitset_get(b, 34 + loop_count));
+        loop_count++;
+    }
+    test_int("Checking view foreach count\n", 33, loop_count);
+    bitset_vector_cardinality(l2, &raw, &unique);
+    test_int("Checking view cardinality\n", 33, raw);
+    b = bitset_vector_merge(l2);
+    test_int("Checking view merge\n", 33, bitset_count(b));
+    bitset_free(b);
+    test_bool("Checking view get\n", true, bitset_vector_get(l2, 150, &view) && bitset_get(&view, 50));
+    test_bool("Checking view get 2\n", false, bitset_vector_get(l2, 201, &view));
+    l4 = bitset_vector_copy(l2);
+    test_int("Checking view copy base offset\n", 0, l4->base_offset);
+    bitset_vector_free(l4);
+    char *view_buffer = l2->buffer;
+    bitset_vector_rebase(l2);
+    test_bool("Checking view rebase\n", true, !l2->base_offset && l2->size && l2->buffer != view_buffer &&
+        bitset_vector_bitsets(l2) == 33 && l2->tail_offset == 198);
+    size_t view_length = bitset_vector_length(l2);
+    l4 = bitset_vector_import(bitset_vector_export(l2), view_length);
+    test_int("Checking view export length\n", view_length, bitset_vector_length(l4));
+    test_int("Checking view export count\n", 33, bitset_vector_bitsets(l4));
+    test_int("Checking view export tail offset\n", 198, l4->tail_offset);
+    test_bool("Checking view export get\n", true, bitset_vector_get(l4, 150, &view) &&
+        bitset_get(&view, 50) && !bitset_vector_get(l4, 51, &view));
+    bitset_vector_free(l2);
+    bitset_vector_free(l4);
+    l2 = bitset_vector_view(l3, 290, BITSET_VECTOR_END);
+    test_int("Checking open view bitset count\n", 4, bitset_vector_bitsets(l2));
+    test_int("Checking open view tail offset\n", 300, l2->tail_offset);
+    bitset_vector_free(l2);
+    l2 = bitset_vector_view(l3, 400, BITSET_VECTOR_END);
+    test_int("Checking empty view\n", 0, bitset_vector_bitsets(l2));
+    test_int("Checking empty view length\n", 0, bitset_vector_length(l2));
+    bitset_vector_free(l2);
+    bitset_vector_free(l3);
+
+    //Check rolling up days into weeks
+    l3 = bitset_vector_new();
+    for (unsigned day = 1; day <= 70; day++) {
+        b = bitset_new();
+        bitset_set(b, day % 10);
+        bitset_set(b, 1000 + day);
+        bitset_vector_push(l3, b, day);
+        bitset_free(b);
+    }
+    l2 = bitset_vector_rollup(l3, 7, BITSET_OR);
+    test_int("Checking rollup bitset count\n", 11, bitset_vector_bitsets(l2));
+    test_int("Checking rollup tail offset\n", 70, l2->tail_offset);
+    test_bool("Checking rollup 1\n", true, bitset_vector_get(l2, 0, &view) && bitset_count(&view) == 12);
+    test_bool("Checking rollup 2\n", true, bitset_vector_get(l2, 7, &view) && bitset_count(&view) == 14);
+    test_bool("Checking rollup 3\n", true, bitset_get(&view, 0) && bitset_get(&view, 1013));
+    test_bool("Checking rollup 4\n", false, bitset_vector_get(l2, 8, &view));
+    bitset_vector_free(l2);
+    l2 = bitset_vector_rollup(l3, 7, BITSET_AND);
+    test_int("Checking rollup and\n", 1, bitset_vector_bitsets(l2));
+    test_bool("Checking rollup and 2\n", true, bitset_vector_get(l2, 70, &view) && bitset_count(&view) == 2);
+    bitset_vector_free(l2);
+    l2 = bitset_vector_rollup(l3, 7, BITSET_XOR);
+    test_int("Checking rollup xor\n", 11, bitset_vector_bitsets(l2));
+    test_bool("Checking rollup xor 2\n", true, bitset_vector_get(l2, 14, &view) && bitset_count(&view) == 14);
+    test_bool("Checking rollup xor 3\n", true, bitset_get(&view, 0) && bitset_get(&view, 1020));
+    bitset_vector_free(l2);
+    l2 = bitset_vector_rollup(l3, 7, BITSET_ANDNOT);
+    test_int("Checking rollup andnot\n", 11, bitset_vector_bitsets(l2));
+    test_bool("Checking rollup andnot 2\n", true, bitset_vector_get(l2, 7, &view) && bitset_count(&view) == 2);
+    test_bool("Checking rollup andnot 3\n", true, bitset_get(&view, 7) && bitset_get(&view, 1007));
+    bitset_vector_free(l2);
+    l2 = bitset_vector_rollup_fn(l3, test_month_bucket, NULL, BITSET_OR, 1);
+    l4 = bitset_vector_rollup_fn(l3, test_month_bucket, NULL, BITSET_OR, 4);
+    test_int("Checking rollup fn\n", 3, bitset_vector_bitsets(l2));
+    test_bool("Checking parallel rollup\n", true, l2->length == l4->length &&
+        l2->count == l4->count && !memcmp(l2->buffer, l4->buffer, l2->length));
+    test_bool("Checking rollup fn 2\n", true, bitset_vector_get(l2, 30, &view) && bitset_count(&view) == 40);
+    bitset_vector_free(l2);
+    bitset_vector_free(l4);
+    bitset_vector_free(l3);
+
+    //Check segmented vectors
+    bitset_vector_segmented_t *segmented = bitset_vector_segmented_new(64);
+    l3 = bitset_vector_new();
+    for (unsigned i = 1; i <= 100; i++) {
+        b = bitset_new();
+        bitset_set(b, i);
+        bitset_set(b, i * 100);
+        bitset_vector_segmented_push(segmented, b, i * 5);
+        bitset_vector_push(l3, b, i * 5);
+        bitset_free(b);
+    }
+    test_int("Checking segmented bitset count\n", 100, bitset_vector_segmented_bitsets(segmented));
+    test_bool("Checking segmented segments\n", true, segmented->length > 10);
+    test_bool("Checking segment size\n", true, segmented->segments[0]->size == 64);
+    test_bool("Checking segmented get 1\n", true, bitset_vector_segmented_get(segmented, 5, &view) &&
+        bitset_get(&view, 1) && bitset_get(&view, 100));
+    test_bool("Checking segmented get 2\n", true, bitset_vector_segmented_get(segmented, 250, &view) &&
+        bitset_get(&view, 50) && bitset_get(&view, 5000));
+    test_bool("Checking segmented get 3\n", true, bitset_vector_segmented_get(segmented, 500, &view) &&
+        bitset_get(&view, 100));
+    test_bool("Checking segmented get 4\n", false, bitset_vector_segmented_get(segmented, 251, &view));
+    test_bool("Checking segmented get 5\n", false, bitset_vector_segmented_get(segmented, 501, &view));
+    bitset_vector_cardinality(segmented->segments[1], &raw, &unique);
+    test_int("Checking segment cardinality\n", segmented->segments[1]->count * 2, raw);
+    l2 = bitset_vector_segmented_export(segmented);
+    test_int("Checking segmented length\n", l3->length, bitset_vector_segmented_length(segmented));
+    test_bool("Checking segmented export\n", true, l2->length == l3->length && l2->count == 100 &&
+        l2->tail_offset == 500 && !memcmp(l2->buffer, l3->buffer, l3->length));
+    bitset_vector_free(l2);
+    bitset_vector_free(l3);
+    bitset_vector_segmented_free(segmented);
+
+    //Check buffered out-of-order writes
+    l2 = bitset_vector_new();
+    l3 = bitset_vector_new();
+    bitset_vector_build_directory(l2, 4);
+    bitset_vector_buffer_t *buffered = bitset_vector_buffer_new(l2, 3);
+    for (unsigned i = 2; i <= 100; i += 2) {
+        b = bitset_new();
+        bitset_set(b, i);
+        bitset_vector_buffer_push(buffered, b, i);
+        if (i == 50) {
+            bitset_set(b, 999);
+        }
+        bitset_vector_push(l3, b, i);
+        if (i == 50) {
+            bitset_free(b);
+            b = bitset_new();
+            bitset_set(b, 5);
+            bitset_vector_push(l3, b, 51);
+        }
+        bitset_free(b);
+    }
+    b = bitset_new();
+    bitset_set(b, 7);
+    bitset_vector_push(l3, b, 200);
+    bitset_vector_buffer_set(buffered, 51, 5);
+    bitset_vector_buffer_set(buffered, 50, 999);
+    test_int("Checking buffered writes are pending\n", 2, buffered->length);
+    bitset_vector_buffer_push(buffered, b, 200);
+    test_int("Checking buffer is flushed at its limit\n", 0, buffered->length);
+    test_bool("Checking buffered writes\n", true, l2->length == l3->length && l2->count == 52 &&
+        l2->tail_offset == 200 && !memcmp(l2->buffer, l3->buffer, l3->length));
+    test_bool("Checking buffered directory\n", true, bitset_vector_get(l2, 51, &view) &&
+        bitset_get(&view, 5) && bitset_vector_get(l2, 100, &view) && bitset_get(&view, 100));
+    bitset_vector_buffer_set(buffered, 200, 8);
+    bitset_vector_buffer_free(buffered);
+    test_bool("Checking buffer is flushed when freed\n", true, bitset_vector_get(l2, 200, &view) &&
+        bitset_count(&view) == 2 && l2->count == 52);
+    buffered = bitset_vector_buffer_new(l2, 0);
+    for (unsigned i = 0; i < 2; i++) {
+        bitset_t *late = bitset_new();
+        bitset_set(late, 3);
+        bitset_set(late, i ? 100000 : 4000);
+        bitset_vector_buffer_push(buffered, late, 10);
+        bitset_free(late);
+    }
+    bitset_vector_buffer_set(buffered, 10, 4);
+    bitset_vector_buffer_free(buffered);
+    test_bool("Checking late bitsets are merged\n", true, bitset_vector_get(l2, 10, &view) &&
+        bitset_count(&view) == 5 && bitset_get(&view, 4) && bitset_get(&view, 10) &&
+        bitset_get(&view, 4000) && bitset_get(&view, 100000));
+    bitset_free(b);
+    bitset_vector_free(l2);
+    bitset_vector_free(l3);
+
+    //Check editing bitsets in place
+    l2 = bitset_vector_new();
+    for (unsigned i = 10; i <= 100; i += 10) {
+        b = bitset_new();
+        bitset_set(b, i);
+        bitset_vector_push(l2, b, i);
+        bitset_free(b);
+    }
+    bitset_vector_build_directory(l2, 2);
+    test_bool("Checking vector set 1\n", false, bitset_vector_set(l2, 50, 100000));
+    test_bool("Checking vector set 2\n", true, bitset_vector_set(l2, 50, 100000));
+    test_bool("Checking vector set 3\n", false, bitset_vector_set(l2, 55, 1));
+    test_bool("Checking vector set 4\n", false, bitset_vector_set(l2, 200, 2));
+    test_bool("Checking vector unset 1\n", false, bitset_vector_unset(l2, 56, 1));
+    test_bool("Checking vector unset 2\n", true, bitset_vector_unset(l2, 10, 10));
+    test_bool("Checking vector unset 3\n", true, bitset_vector_unset(l2, 200, 2));
+    test_int("Checking vector edit count\n", 10, l2->count);
+    test_int("Checking vector edit tail\n", 100, l2->tail_offset);
+    test_bool("Checking vector edits\n", true, !bitset_vector_get(l2, 10, &view) &&
+        bitset_vector_get(l2, 50, &view) && bitset_count(&view) == 2 && bitset_get(&view, 100000) &&
+        bitset_vector_get(l2, 55, &view) && bitset_get(&view, 1) &&
+        bitset_vector_get(l2, 60, &view) && bitset_get(&view, 60));
+    l3 = bitset_vector_copy(l2);
+    bitset_vector_init(l3);
+    test_bool("Checking vector edits are canonical\n", true, l3->count == l2->count &&
+        l3->tail_offset == l2->tail_offset && bitset_vector_bitsets(l3) == 10);
+    bitset_vector_free(l2);
+    bitset_vector_free(l3);
+
+    //Check stored counts
+    l2 = bitset_vector_new();
+    l3 = bitset_vector_new();
+    bitset_vector_store_counts(l2);
+    for (unsigned i = 1; i <= 20; i++) {
+        b = bitset_new();
+        for (unsigned j = 0; j < i; j++) {
+            bitset_set(b, j * 100);
+        }
+        if (i <= 10) {
+            bitset_vector_push(l2, b, i);
+        } else {
+            bitset_vector_push(l3, b, i - 11);
+        }
+        bitset_free(b);
+    }
+    bitset_vector_concat(l2, l3, 11, BITSET_VECTOR_START, BITSET_VECTOR_END);
+    bitset_vector_set(l2, 5, 1);
+    bitset_vector_set(l2, 25, 1);
+    bitset_vector_unset(l2, 1, 0);
+    unsigned stored_offsets[20];
+    bitset_offset stored_counts[20];
+    test_int("Checking stored counts length\n", 20, bitset_vector_counts(l2, BITSET_VECTOR_START,
+        BITSET_VECTOR_END, NULL, stored_offsets, stored_counts));
+    test_bool("Checking stored counts\n", true, stored_offsets[0] == 2 && stored_counts[0] == 2 &&
+        stored_counts[3] == 6 && stored_counts[18] == 20 && stored_counts[19] == 1);
+    bitset_vector_cardinality(l2, &raw, NULL);
+    test_int("Checking stored raw count\n", 211, raw);
+    l4 = bitset_vector_view(l2, 15, BITSET_VECTOR_END);
+    test_int("Checking stored counts in a view\n", 7, bitset_vector_counts(l4, BITSET_VECTOR_START,
+        BITSET_VECTOR_END, NULL, stored_offsets, stored_counts));
+    test_bool("Checking stored counts in a view 2\n", true, stored_offsets[0] == 15 && stored_counts[0] == 15);
+    bitset_vector_free(l4);
+    size_t trailer_length = bitset_vector_trailer_length(l2);
+    test_int("Checking stored counts are exported\n", BITSET_VECTOR_TRAILER_LENGTH + 20 * 8, trailer_length);
+    char *stored = bitset_malloc(l2->length + trailer_length);
+    memcpy(stored, l2->buffer, l2->length);
+    bitset_vector_export_trailer(l2, stored + l2->length);
+    l4 = bitset_vector_import(stored, l2->length + trailer_length);
+    test_bool("Checking stored counts are imported\n", true, l4->popcounts && l4->count == 20 &&
+        l4->length == l2->length && !memcmp(l4->popcounts, l2->popcounts, sizeof(bitset_offset) * 20));
+    bitset_malloc_free(stored);
+    bitset_vector_free(l4);
+    l4 = bitset_vector_view(l2, 15, BITSET_VECTOR_END);
+    bitset_vector_rebase(l4);
+    view_length = bitset_vector_length(l4);
+    trailer_length = bitset_vector_trailer_length(l4);
+    stored = bitset_malloc(view_length + trailer_length);
+    memcpy(stored, bitset_vector_export(l4), view_length);
+    bitset_vector_export_trailer(l4, stored + view_length);
+    bitset_vector_free(l4);
+    l4 = bitset_vector_import(stored, view_length + trailer_length);
+    test_bool("Checking a view is imported from its trailer\n", true, l4->popcounts && l4->count == 7 &&
+        l4->tail_offset == l2->tail_offset && l4->popcounts[0] == 15 && bitset_vector_get(l4, 15, &view) &&
+        bitset_count(&view) == 15 && !bitset_vector_get(l4, 14, &view));
+    bitset_malloc_free(stored);
+    bitset_vector_free(l2);
+    bitset_vector_free(l3);
+    bitset_vector_free(l4);
+
+    //Check unique counting strategies
+    l3 = bitset_vector_new();
+    for (unsigned i = 1; i <= 200; i++) {
+        b = bitset_new();
+        for (unsigned j = 0; j < 50; j++) {
+            bitset_set(b, (i * 7 + j * 13) % 5000);
+        }
+        bitset_set(b, 10000000 + i);
+        bitset_vector_push(l3, b, i);
+        bitset_free(b);
+    }
+    b = bitset_vector_merge(l3);
+    unsigned expected = bitset_count(b);
+    bitset_free(b);
+    bitset_vector_cardinality_with(l3, &raw, &unique, BITSET_CARDINALITY_EXACT, 0);
+    test_int("Checking exact raw count\n", 200 * 51, raw);
+    test_int("Checking exact unique count\n", expected, unique);
+    bitset_vector_cardinality_with(l3, &raw, &unique, BITSET_CARDINALITY_HLL, 0.02);
+    test_bool("Checking hll unique count\n", true, unique > expected * 0.94 && unique < expected * 1.06);
+
+    //Check per-offset counts
+    unsigned *count_offsets = bitset_malloc(sizeof(unsigned) * bitset_vector_bitsets(l3));
+    bitset_offset *counts = bitset_malloc(sizeof(bitset_offset) * bitset_vector_bitsets(l3));
+    test_int("Checking counts length\n", 200, bitset_vector_counts(l3, BITSET_VECTOR_START,
+        BITSET_VECTOR_END, NULL, count_offsets, counts));
+    test_bool("Checking counts\n", true, count_offsets[0] == 1 && counts[0] == 51 &&
+        count_offsets[199] == 200 && counts[199] == 51);
+    test_int("Checking counts range\n", 10, bitset_vector_counts(l3, 50, 60, NULL, count_offsets, counts));
+    test_bool("Checking counts range 2\n", true, count_offsets[0] == 50 && count_offsets[9] == 59);
+    BITSET_NEW(b2, 7, 20, 33, 10000010, 10000050);
+    size_t count_length = bitset_vector_counts(l3, BITSET_VECTOR_START, BITSET_VECTOR_END, b2, count_offsets, counts);
+    bool counts_match = count_length == 200;
+    for (size_t i = 0; i < count_length; i++) {
+        bitset_t *masked;
+        bitset_vector_get(l3, count_offsets[i], &view);
+        bitset_operation_t *op = bitset_operation_new(&view);
+        bitset_operation_add(op, b2, BITSET_AND);
+        masked = bitset_operation_exec(op);
+        counts_match = counts_match && bitset_count(masked) == counts[i];
+        bitset_operation_free(op);
+        bitset_free(masked);
+    }
+    test_bool("Checking masked counts\n", true, counts_match);
+    test_bool("Checking masked counts 2\n", true, counts[9] == 1 && counts[49] == 1);
+    bitset_free(b2);
+
+    //Check masked counts against a dense mask
+    b2 = bitset_new();
+    for (unsigned i = 0; i < 20000; i += 2) {
+        bitset_set(b2, i);
+    }
+    count_length = bitset_vector_mask_count(l3, b2, count_offsets, counts);
+    counts_match = count_length == 200;
+    for (size_t i = 0; i < count_length; i++) {
+        bitset_t *masked;
+        bitset_vector_get(l3, count_offsets[i], &view);
+        bitset_operation_t *op = bitset_operation_new(&view);
+        bitset_operation_add(op, b2, BITSET_AND);
+        masked = bitset_operation_exec(op);
+        counts_match = counts_match && bitset_count(masked) == counts[i] && counts[i] >= 24;
+        bitset_operation_free(op);
+        bitset_free(masked);
+    }
+    test_bool("Checking mask count\n", true, counts_match);
+    bitset_free(b2);
+    bitset_malloc_free(count_offsets);
+    bitset_malloc_free(counts);
+    bitset_vector_free(l3);
+
+    //Check retention matrices
+    l3 = bitset_vector_new();
+    for (unsigned day = 1; day <= 10; day++) {
+        if (day == 5) {
+            continue;
+        }
+        b = bitset_new();
+        for (unsigned user = day * 10; user < day * 10 + 100; user++) {
+            bitset_set(b, user);
+        }
+        bitset_vector_push(l3, b, day);
+        bitset_free(b);
+    }
+    bitset_offset *matrix = bitset_malloc(sizeof(bitset_offset) * 9 * 4);
+    bitset_offset *parallel_matrix = bitset_malloc(sizeof(bitset_offset) * 9 * 4);
+    bitset_vector_retention(l3, 3, matrix, 1);
+    bitset_vector_retention(l3, 3, parallel_matrix, 3);
+    test_bool("Checking retention 1\n", true, matrix[0] == 100 && matrix[1] == 90 &&
+        matrix[2] == 80 && matrix[3] == 70);
+    test_bool("Checking retention 2\n", true, matrix[4 * 3] == 100 && matrix[4 * 3 + 1] == 0 &&
+        matrix[4 * 3 + 2] == 80);
+    test_bool("Checking retention 3\n", true, matrix[4 * 8] == 100 && matrix[4 * 8 + 1] == 0);
+    test_bool("Checking parallel retention\n", true, !memcmp(matrix, parallel_matrix, sizeof(bitset_offset) * 9 * 4));
+    bitset_vector_retention(l3, 3, parallel_matrix, 16);
+    test_bool("Checking parallel retention 2\n", true, !memcmp(matrix, parallel_matrix, sizeof(bitset_offset) * 9 * 4));
+    bitset_malloc_free(matrix);
+    bitset_malloc_free(parallel_matrix);
+    bitset_vector_free(l3);
+
+    //Check funnels
+    bitset_vector_t *funnel[3];
+    bitset_offset funnel_counts[3];
+    for (unsigned i = 0; i < 3; i++) {
+        funnel[i] = bitset_vector_new();
+    }
+    BITSET_NEW(f1, 1, 2, 3, 4);
+    BITSET_NEW(f2, 5);
+    BITSET_NEW(f3, 1, 2, 5);
+    BITSET_NEW(f4, 3);
+    BITSET_NEW(f5, 1);
+    BITSET_NEW(f6, 2);
+    bitset_vector_push(funnel[0], f1, 1);
+    bitset_vector_push(funnel[0], f2, 5);
+    bitset_vector_push(funnel[1], f3, 2);
+    bitset_vector_push(funnel[1], f4, 4);
+    bitset_vector_push(funnel[1], f2, 6);
+    bitset_vector_push(funnel[2], f5, 3);
+    bitset_vector_push(funnel[2], f6, 7);
+    bitset_vector_push(funnel[2], f2, 8);
+    b = bitset_funnel_exec(funnel, 3, 2, funnel_counts);
+    test_bool("Checking funnel counts\n", true, funnel_counts[0] == 5 &&
+        funnel_counts[1] == 3 && funnel_counts[2] == 2);
+    test_bool("Checking funnel result\n", true, bitset_count(b) == 2 &&
+        bitset_get(b, 1) && bitset_get(b, 5));
+    bitset_free(b);
+    b = bitset_funnel_exec(funnel, 3, 0, funnel_counts);
+    test_bool("Checking funnel without a window\n", true, funnel_counts[0] == 5 &&
+        funnel_counts[1] == 0 && funnel_counts[2] == 0 && !bitset_count(b));
+    bitset_free(b);
+    bitset_free(f1);
+    bitset_free(f2);
+    bitset_free(f3);
+    bitset_free(f4);
+    bitset_free(f5);
+    bitset_free(f6);
+    for (unsigned i = 0; i < 3; i++) {
+        bitset_vector_free(funnel[i]);
+    }
+
     //Make a copy of the buffer
     char *buffer = bitset_malloc(sizeof(char) * l->length);
     memcpy(buffer, l->buffer, l->length);
@@ -990,14 +1755,75 @@ void test_suite_vector() {
     test_int("Check size is copied\n", 32, l->size);
     test_int("Check length is copied\n", 20, l->length);
     test_int("Check tail_offset is copied\n", 10, l->tail_offset);
+
+    //Check the trailer is used in place of a scan
+    bitset_vector_trailer_t trailer;
+    bitset_malloc_free(buffer);
+    buffer = bitset_malloc(sizeof(char) * (length + BITSET_VECTOR_TRAILER_LENGTH));
+    memcpy(buffer, l->buffer, length);
+    bitset_vector_export_trailer(l, buffer + length);
+    bitset_vector_cardinality(l, &raw, NULL);
+    test_bool("Check trailer is read\n", true, bitset_vector_read_trailer(buffer,
+        length + BITSET_VECTOR_TRAILER_LENGTH, &trailer) && trailer.length == length &&
+        trailer.raw == raw && trailer.count == l->count && trailer.tail_offset == 10 &&
+        trailer.version == BITSET_VECTOR_TRAILER_VERSION && !trailer.flags);
+    test_bool("Check trailer needs the full buffer\n", false, bitset_vector_read_trailer(buffer,
+        length + BITSET_VECTOR_TRAILER_LENGTH - 1, &trailer));
+    test_bool("Check plain buffer has no trailer\n", false, bitset_vector_read_trailer(buffer, length, &trailer));
+    bitset_vector_free(l);
+    l = bitset_vector_import(buffer, length + BITSET_VECTOR_TRAILER_LENGTH);
+    test_int("Check length is read from trailer\n", 20, l->length);
+    test_int("Check tail_offset is read from trailer\n", 10, l->tail_offset);
+    test_int("Check count is read from trailer\n", trailer.count, l->count);
+    buffer[length + 28]++;
+    test_bool("Check trailer checksum\n", false, bitset_vector_read_trailer(buffer,
+        length + BITSET_VECTOR_TRAILER_LENGTH, &trailer));
+    buffer[length + 28]--;
+    buffer[1]++;
+    test_bool("Check trailer checksum covers the first delta\n", false, bitset_vector_read_trailer(buffer,
+        length + BITSET_VECTOR_TRAILER_LENGTH, &trailer));
+    buffer[1]--;
+
+    //Check a trailer from a newer version is ignored
+    buffer[length + 33] = BITSET_VECTOR_TRAILER_VERSION + 1;
+    buffer[length + 27]++;
+    test_trailer_checksum(buffer, length);
+    test_bool("Check newer trailer is read\n", true, bitset_vector_read_trailer(buffer,
+        length + BITSET_VECTOR_TRAILER_LENGTH, &trailer) && trailer.tail_offset == 11);
+    bitset_vector_free(l);
+    l = bitset_vector_import(buffer, length + BITSET_VECTOR_TRAILER_LENGTH);
+    test_int("Check newer trailer falls back to a scan\n", 10, l->tail_offset);
+    test_int("Check newer trailer length\n", 20, l->length);
     bitset_vector_free(l);
     bitset_malloc_free(buffer);
 }
 
+static bitset_vector_t *test_resolve(void *data, void *context) {
+    return *(bitset_vector_t **) data;
+}
+
+static void test_resolve_bulk(void **data, bitset_vector_t **vectors, size_t count, void *context) {
+    for (size_t i = 0; i < count; i++) {
+        vectors[i] = *(bitset_vector_t **) data[i];
+    }
+    *(size_t *) context += count;
+}
+
+static bitset_vector_operation_t *test_lazy_operation(bitset_vector_t **shards) {
+    bitset_vector_operation_t *operation = bitset_vector_operation_new(NULL);
+    bitset_vector_operation_t *nested = bitset_vector_operation_new(NULL);
+    bitset_vector_operation_add_data(operation, &shards[0], BITSET_OR);
+    bitset_vector_operation_add_data(nested, &shards[1], BITSET_OR);
+    bitset_vector_operation_add_data(nested, &shards[2], BITSET_OR);
+    bitset_vector_operation_add_nested(operation, nested, BITSET_AND);
+    bitset_vector_operation_add_data(operation, &shards[3], BITSET_ANDNOT);
+    return operation;
+}
+
 void test_suite_vector_operation() {
     bitset_vector_operation_t *o1, *o2;
-    bitset_vector_t *v1, *v2, *v3, *v4, *v5;
-    bitset_t *b1, *b2, *b3, *b4;
+    bitset_vector_t *v1, *v2, *v3, *v4, *v5, *v6;
+    bitset_t *b1, *b2, *b3, *b4, view;
     unsigned offset;
 
     b1 = bitset_new();
@@ -1105,6 +1931,381 @@ void test_suite_vector_operation() {
         }
     }
     test_int("Check vector operation looped right amount of times\n", 4, loop_count);
+    bitset_vector_free(v5);
+
+    //V1 AND a view of V2
+    v6 = bitset_vector_view(v2, 3, 7);
+    o1 = bitset_vector_operation_new(v1);
+    bitset_vector_operation_add(o1, v6, BITSET_AND);
+    v5 = bitset_vector_operation_exec(o1);
+    bitset_vector_operation_free(o1);
+    bitset_vector_free(v6);
+    test_int("Check vector view operation count\n", 1, bitset_vector_bitsets(v5));
+    test_bool("Check vector view operation\n", true, bitset_vector_get(v5, 4, &view) &&
+        bitset_count(&view) == 1 && bitset_get(&view, 100));
+
+    bitset_vector_free(v5);
+
+    //V1 ANDNOT V2 only removes bits where V2 has a bitset
+    o1 = bitset_vector_operation_new(v1);
+    bitset_vector_operation_add(o1, v2, BITSET_ANDNOT);
+    v5 = bitset_vector_operation_exec(o1);
+    bitset_vector_operation_free(o1);
+    test_int("Check vector andnot count\n", 3, bitset_vector_bitsets(v5));
+    test_bool("Check vector andnot 1\n", true, bitset_vector_get(v5, 1, &view) && bitset_get(&view, 100));
+    test_bool("Check vector andnot 2\n", true, bitset_vector_get(v5, 2, &view) && bitset_get(&view, 100));
+    test_bool("Check vector andnot 3\n", false, bitset_vector_get(v5, 4, &view));
+    test_bool("Check vector andnot 4\n", false, bitset_vector_get(v5, 6, &view));
+    bitset_vector_free(v5);
+
+    //Offsets that are far apart don't need a bucket per offset
+    v5 = bitset_vector_new();
+    v6 = bitset_vector_new();
+    b1 = bitset_new();
+    bitset_set(b1, 10);
+    bitset_vector_push(v5, b1, 0);
+    bitset_vector_push(v6, b1, 2000000000);
+    bitset_vector_push(v5, b1, 2000000001);
+    bitset_free(b1);
+    o1 = bitset_vector_operation_new(v5);
+    bitset_vector_operation_add(o1, v6, BITSET_XOR);
+    bitset_vector_free(v1);
+    v1 = bitset_vector_operation_exec(o1);
+    bitset_vector_operation_free(o1);
+    test_int("Check wide vector operation count\n", 3, bitset_vector_bitsets(v1));
+    test_int("Check wide vector operation tail\n", 2000000001, v1->tail_offset);
+    test_bool("Check wide vector operation\n", true, bitset_vector_get(v1, 2000000000, &view) &&
+        bitset_get(&view, 10));
+    bitset_vector_free(v6);
+
+    //Parallel execution gives the same result as sequential execution
+    bitset_vector_t *w1 = bitset_vector_new(), *w2 = bitset_vector_new(), *seq = NULL, *par;
+    for (unsigned i = 1; i <= 1000; i++) {
+        b1 = bitset_new();
+        bitset_set(b1, i % 7);
+        bitset_set(b1, 100 + i % 13);
+        bitset_vector_push(w1, b1, i);
+        if (i % 3) {
+            bitset_vector_push(w2, b1, i * 2);
+        }
+        bitset_free(b1);
+    }
+    for (unsigned threads = 1; threads <= 8; threads *= 2) {
+        o1 = bitset_vector_operation_new(w1);
+        o2 = bitset_vector_operation_new(w2);
+        bitset_vector_operation_add(o2, v2, BITSET_XOR);
+        bitset_vector_operation_add_nested(o1, o2, BITSET_ANDNOT);
+        bitset_vector_operation_add(o1, v3, BITSET_OR);
+        par = bitset_vector_operation_exec_parallel(o1, threads);
+        bitset_vector_operation_free(o1);
+        if (!seq) {
+            seq = par;
+            continue;
+        }
+        test_bool("Check parallel vector operation\n", true, seq->length == par->length &&
+            seq->count == par->count && seq->tail_offset == par->tail_offset &&
+            !memcmp(seq->buffer, par->buffer, seq->length));
+        bitset_vector_free(par);
+    }
+    test_int("Check parallel vector operation count\n", 996, bitset_vector_bitsets(seq));
+    bitset_vector_free(w1);
+    bitset_vector_free(w2);
+    bitset_vector_free(seq);
+
+    //Shifted operands line up with other periods
+    w1 = bitset_vector_new();
+    w2 = bitset_vector_new();
+    for (unsigned day = 1; day <= 7; day++) {
+        b1 = bitset_new();
+        bitset_set(b1, day);
+        bitset_set(b1, 100);
+        bitset_vector_push(w1, b1, day);
+        bitset_free(b1);
+        b1 = bitset_new();
+        bitset_set(b1, day);
+        bitset_set(b1, 200);
+        bitset_vector_push(w2, b1, day + 7);
+        bitset_free(b1);
+    }
+    o1 = bitset_vector_operation_new(w2);
+    bitset_vector_operation_add_shifted(o1, w1, 7, BITSET_ANDNOT);
+    seq = bitset_vector_operation_exec(o1);
+    bitset_vector_operation_free(o1);
+    test_int("Check shifted operation count\n", 7, bitset_vector_bitsets(seq));
+    test_bool("Check shifted operation\n", true, bitset_vector_get(seq, 10, &view) &&
+        bitset_count(&view) == 1 && bitset_get(&view, 200));
+    bitset_vector_free(seq);
+    o1 = bitset_vector_operation_new(w1);
+    bitset_vector_operation_add_shifted(o1, w2, -9, BITSET_OR);
+    seq = bitset_vector_operation_exec(o1);
+    bitset_vector_operation_free(o1);
+    test_int("Check negative shift count\n", 8, bitset_vector_bitsets(seq));
+    test_bool("Check negative shift\n", true, bitset_vector_get(seq, 1, &view) &&
+        bitset_count(&view) == 4 && bitset_get(&view, 3) && bitset_get(&view, 200));
+    bitset_vector_free(seq);
+    o1 = bitset_vector_operation_new(NULL);
+    bitset_vector_operation_add_shifted(o1, w2, -9, BITSET_OR);
+    seq = bitset_vector_operation_exec(o1);
+    bitset_vector_operation_free(o1);
+    test_bool("Check single shifted operand\n", true, bitset_vector_bitsets(seq) == 6 &&
+        seq->tail_offset == 5 && bitset_vector_get(seq, 1, &view) && bitset_get(&view, 3));
+    bitset_vector_free(seq);
+    o1 = bitset_vector_operation_new(w2);
+    bitset_vector_operation_add_shifted(o1, w1, 9, BITSET_XOR);
+    seq = bitset_vector_operation_exec(o1);
+    bitset_vector_operation_free(o1);
+    o1 = bitset_vector_operation_new(w2);
+    bitset_vector_operation_add_shifted(o1, w1, 9, BITSET_XOR);
+    par = bitset_vector_operation_exec_parallel(o1, 3);
+    bitset_vector_operation_free(o1);
+    test_bool("Check parallel shifted operation\n", true, seq->length == par->length &&
+        seq->count == 9 && !memcmp(seq->buffer, par->buffer, seq->length));
+    bitset_vector_free(seq);
+    bitset_vector_free(par);
+    bitset_vector_free(w1);
+    bitset_vector_free(w2);
+
+    //Bitsets shifted past UINT_MAX are skipped
+    w1 = bitset_vector_new();
+    for (unsigned i = 1; i <= 3; i++) {
+        b1 = bitset_new();
+        bitset_set(b1, 9);
+        bitset_vector_push(w1, b1, i << 30);
+        bitset_free(b1);
+    }
+    for (unsigned i = 0; i < 3; i++) {
+        b1 = bitset_new();
+        bitset_set(b1, i);
+        bitset_vector_push(w1, b1, UINT_MAX - 12 + i * 4);
+        bitset_free(b1);
+    }
+    o1 = bitset_vector_operation_new(NULL);
+    bitset_vector_operation_add_shifted(o1, w1, 6, BITSET_OR);
+    seq = bitset_vector_operation_exec(o1);
+    bitset_vector_operation_free(o1);
+    test_bool("Check shift near the offset limit\n", true, bitset_vector_bitsets(seq) == 5 &&
+        seq->tail_offset == UINT_MAX - 2 && bitset_vector_get(seq, UINT_MAX - 6, &view) && bitset_get(&view, 0));
+    bitset_vector_free(seq);
+    o1 = bitset_vector_operation_new(NULL);
+    bitset_vector_operation_add_shifted(o1, w1, 13, BITSET_OR);
+    seq = bitset_vector_operation_exec(o1);
+    bitset_vector_operation_free(o1);
+    test_bool("Check shift past the offset limit\n", true, bitset_vector_bitsets(seq) == 3 &&
+        seq->tail_offset == (3U << 30) + 13);
+    bitset_vector_free(seq);
+    o1 = bitset_vector_operation_new(w1);
+    bitset_vector_operation_add_shifted(o1, w1, 4, BITSET_OR);
+    seq = bitset_vector_operation_exec(o1);
+    bitset_vector_operation_free(o1);
+    test_bool("Check shift near the offset limit 2\n", true, bitset_vector_bitsets(seq) == 10 &&
+        seq->tail_offset == UINT_MAX && bitset_vector_get(seq, UINT_MAX - 4, &view) &&
+        bitset_count(&view) == 2 && bitset_get(&view, 1) && bitset_get(&view, 2));
+    bitset_vector_free(seq);
+    o1 = bitset_vector_operation_new(w1);
+    bitset_vector_operation_add_shifted(o1, w1, 4, BITSET_OR);
+    seq = bitset_vector_operation_exec_parallel(o1, 4);
+    bitset_vector_operation_free(o1);
+    test_bool("Check parallel shift near the offset limit\n", true, bitset_vector_bitsets(seq) == 10 &&
+        seq->tail_offset == UINT_MAX);
+    bitset_vector_free(seq);
+    bitset_vector_free(w1);
+
+    //Ranges are pushed down to operands and nested operations
+    w1 = bitset_vector_new();
+    w2 = bitset_vector_new();
+    for (unsigned i = 1; i <= 1000; i++) {
+        b1 = bitset_new();
+        bitset_set(b1, i % 11);
+        bitset_vector_push(w1, b1, i);
+        if (i % 2) {
+            bitset_vector_push(w2, b1, i);
+        }
+        bitset_free(b1);
+    }
+    bitset_vector_build_directory(w1, 16);
+    for (unsigned threads = 1; threads <= 4; threads *= 4) {
+        o1 = bitset_vector_operation_new(w1);
+        o2 = bitset_vector_operation_new(w2);
+        bitset_vector_operation_add(o2, v2, BITSET_OR);
+        bitset_vector_operation_add_nested(o1, o2, BITSET_AND);
+        bitset_vector_operation_set_range(o1, 100, 200);
+        seq = bitset_vector_operation_exec_parallel(o1, threads);
+        bitset_vector_operation_free(o1);
+        test_int("Check ranged operation count\n", 50, bitset_vector_bitsets(seq));
+        test_int("Check ranged operation tail\n", 199, seq->tail_offset);
+        test_bool("Check ranged operation\n", true, !bitset_vector_get(seq, 99, &view) &&
+            bitset_vector_get(seq, 101, &view) && bitset_get(&view, 101 % 11));
+        bitset_vector_free(seq);
+    }
+    o1 = bitset_vector_operation_new(w1);
+    bitset_vector_operation_set_range(o1, 990, BITSET_VECTOR_END);
+    seq = bitset_vector_operation_exec(o1);
+    bitset_vector_operation_free(o1);
+    test_bool("Check ranged single operand\n", true, bitset_vector_bitsets(seq) == 11 &&
+        seq->tail_offset == 1000 && !seq->base_offset);
+    bitset_vector_free(seq);
+    v6 = bitset_vector_new();
+    b1 = bitset_new();
+    bitset_set(b1, 1);
+    bitset_vector_push(v6, b1, 3);
+    bitset_vector_push(v6, b1, 10);
+    bitset_vector_push(v6, b1, 20);
+    bitset_free(b1);
+    o1 = bitset_vector_operation_new(NULL);
+    o2 = bitset_vector_operation_new(v6);
+    bitset_vector_operation_set_range(o2, 15, 25);
+    bitset_vector_operation_add_nested(o1, o2, BITSET_OR);
+    bitset_vector_operation_set_range(o1, 0, 30);
+    seq = bitset_vector_operation_exec(o1);
+    bitset_vector_operation_free(o1);
+    test_bool("Check nested range is kept\n", true, bitset_vector_bitsets(seq) == 1 &&
+        bitset_vector_get(seq, 20, &view));
+    bitset_vector_free(seq);
+    bitset_vector_free(v6);
+
+    //Counting an operation matches counting the materialised result
+    o1 = bitset_vector_operation_new(w1);
+    bitset_vector_operation_add_shifted(o1, w2, 1, BITSET_XOR);
+    seq = bitset_vector_operation_exec(o1);
+    bitset_vector_operation_free(o1);
+    o1 = bitset_vector_operation_new(w1);
+    bitset_vector_operation_add_shifted(o1, w2, 1, BITSET_XOR);
+    unsigned *op_offsets, raw;
+    bitset_offset op_raw, *op_counts;
+    size_t op_length = bitset_vector_operation_count(o1, &op_raw, &op_offsets, &op_counts);
+    bitset_vector_operation_free(o1);
+    bitset_vector_cardinality(seq, &raw, NULL);
+    test_bool("Check operation count\n", true, op_length == bitset_vector_bitsets(seq) && op_raw == raw);
+    test_bool("Check operation count offsets\n", true, op_offsets[0] == 1 && op_counts[0] == 1 &&
+        bitset_vector_get(seq, op_offsets[op_length - 1], &view) &&
+        bitset_count(&view) == op_counts[op_length - 1]);
+    bitset_malloc_free(op_offsets);
+    bitset_malloc_free(op_counts);
+    bitset_vector_free(seq);
+    o1 = bitset_vector_operation_new(w1);
+    bitset_vector_operation_add(o1, w2, BITSET_AND);
+    bitset_vector_operation_set_range(o1, 100, 200);
+    test_int("Check ranged operation count only\n", 50, bitset_vector_operation_count(o1, &op_raw, NULL, NULL));
+    test_int("Check ranged operation raw count\n", 50, op_raw);
+    bitset_vector_operation_free(o1);
+    bitset_vector_free(w1);
+    bitset_vector_free(w2);
+
+    //Merging many shards gives the same result as chained operations
+    bitset_vector_t *shards[4];
+    for (unsigned shard = 0; shard < 4; shard++) {
+        shards[shard] = bitset_vector_new();
+        for (unsigned i = shard; i < 100; i += shard + 1) {
+            b1 = bitset_new();
+            bitset_set(b1, shard * 1000 + i);
+            bitset_set(b1, i);
+            bitset_vector_push(shards[shard], b1, i + 1);
+            bitset_free(b1);
+        }
+    }
+    o1 = bitset_vector_operation_new(shards[0]);
+    for (unsigned shard = 1; shard < 4; shard++) {
+        bitset_vector_operation_add(o1, shards[shard], BITSET_OR);
+    }
+    seq = bitset_vector_operation_exec(o1);
+    bitset_vector_operation_free(o1);
+    par = bitset_vector_merge_many(shards, 4, BITSET_OR);
+    test_bool("Check merge many\n", true, seq->length == par->length && seq->count == par->count &&
+        !memcmp(seq->buffer, par->buffer, seq->length));
+    test_int("Check merge many count\n", 100, bitset_vector_bitsets(par));
+    test_bool("Check merge many bitset\n", true, bitset_vector_get(par, 12, &view) &&
+        bitset_count(&view) == 4 && bitset_get(&view, 11) && bitset_get(&view, 3011));
+    bitset_vector_free(seq);
+    bitset_vector_free(par);
+    par = bitset_vector_merge_many(shards, 4, BITSET_AND);
+    test_int("Check merge many and\n", 8, bitset_vector_bitsets(par));
+    bitset_vector_free(par);
+
+    //Lazy operands resolve the same way sequentially, in bulk and in parallel
+    size_t resolved = 0;
+    o1 = test_lazy_operation(shards);
+    bitset_vector_operation_resolve_data(o1, test_resolve, NULL);
+    seq = bitset_vector_operation_exec(o1);
+    bitset_vector_operation_free(o1);
+    o1 = test_lazy_operation(shards);
+    bitset_vector_operation_resolve_data_bulk(o1, test_resolve_bulk, &resolved);
+    par = bitset_vector_operation_exec(o1);
+    bitset_vector_operation_free(o1);
+    test_int("Check bulk resolve count\n", 4, resolved);
+    test_bool("Check bulk resolve\n", true, seq->length && seq->length == par->length &&
+        !memcmp(seq->buffer, par->buffer, seq->length));
+    bitset_vector_free(par);
+    o1 = test_lazy_operation(shards);
+    bitset_vector_operation_resolve_data_parallel(o1, test_resolve, NULL, 4);
+    par = bitset_vector_operation_exec(o1);
+    bitset_vector_operation_free(o1);
+    test_bool("Check parallel resolve\n", true, seq->length == par->length &&
+        !memcmp(seq->buffer, par->buffer, seq->length));
+    bitset_vector_free(seq);
+    bitset_vector_free(par);
+    bitset_vector_t *missing[2] = { shards[0], NULL };
+    o1 = bitset_vector_operation_new(NULL);
+    bitset_vector_operation_add_data(o1, &missing[0], BITSET_OR);
+    bitset_vector_operation_add_data(o1, &missing[1], BITSET_AND);
+    bitset_vector_operation_resolve_data(o1, test_resolve, NULL);
+    par = bitset_vector_operation_exec(o1);
+    bitset_vector_operation_free(o1);
+    test_int("Check unresolved and operand\n", 0, bitset_vector_bitsets(par));
+    bitset_vector_free(par);
+    for (unsigned shard = 0; shard < 4; shard++) {
+        bitset_vector_free(shards[shard]);
+    }
+
+    //(V1 AND V2) OR V3 where V2 has no word at bit 5000
+    bitset_vector_t *folds[3];
+    unsigned fold_bits[3][2] = { { 1, 5000 }, { 1, 1 }, { 6000, 6000 } };
+    for (unsigned i = 0; i < 3; i++) {
+        b1 = bitset_new();
+        bitset_set(b1, fold_bits[i][0]);
+        bitset_set(b1, fold_bits[i][1]);
+        folds[i] = bitset_vector_new();
+        bitset_vector_push(folds[i], b1, 7);
+        bitset_free(b1);
+    }
+    o1 = bitset_vector_operation_new(folds[0]);
+    bitset_vector_operation_add(o1, folds[1], BITSET_AND);
+    bitset_vector_operation_add(o1, folds[2], BITSET_OR);
+    par = bitset_vector_operation_exec(o1);
+    test_bool("Check streaming fold\n", true, bitset_vector_get(par, 7, &view) &&
+        bitset_count(&view) == 2 && bitset_get(&view, 1) && bitset_get(&view, 6000));
+    bitset_offset fold_raw = 0;
+    test_int("Check streaming fold count\n", 1, bitset_vector_operation_count(o1, &fold_raw, NULL, NULL));
+    test_int("Check streaming fold count 2\n", 2, fold_raw);
+    bitset_vector_operation_free(o1);
+    bitset_vector_free(par);
+
+    //Bitsets from a single operand are counted from its stored counts
+    bitset_vector_store_counts(folds[0]);
+    b1 = bitset_new();
+    bitset_set(b1, 3);
+    bitset_vector_push(folds[0], b1, 9);
+    bitset_vector_push(folds[0], b1, 11);
+    bitset_free(b1);
+    folds[0]->popcounts[1] = 40;
+    folds[0]->popcounts[2] = 50;
+    o1 = bitset_vector_operation_new(folds[0]);
+    bitset_vector_operation_add(o1, folds[2], BITSET_OR);
+    unsigned *fold_offsets;
+    bitset_offset *fold_counts;
+    test_int("Check stored operand counts\n", 3, bitset_vector_operation_count(o1, &fold_raw,
+        &fold_offsets, &fold_counts));
+    test_bool("Check stored operand counts 2\n", true, fold_raw == 93 && fold_offsets[1] == 9 &&
+        fold_counts[0] == 3 && fold_counts[1] == 40 && fold_counts[2] == 50);
+    bitset_malloc_free(fold_offsets);
+    bitset_malloc_free(fold_counts);
+    bitset_vector_operation_set_range(o1, 10, BITSET_VECTOR_END);
+    test_int("Check stored operand counts in a range\n", 1, bitset_vector_operation_count(o1, &fold_raw,
+        NULL, NULL));
+    test_int("Check stored operand counts in a range 2\n", 50, fold_raw);
+    bitset_vector_operation_free(o1);
+    for (unsigned i = 0; i < 3; i++) {
+        bitset_vector_free(folds[i]);
+    }
 
     bitset_vector_free(v1);
     bitset_vector_free(v2);
@@ -1168,5 +2369,25 @@ void test_suite_estimate() {
     bitset_free(b5);
     bitset_free(b6);
     bitset_free(b7);
+
+    bitset_hll_t *h = bitset_hll_new(0.01);
+    test_int("Test hll size\n", 16384, h->size);
+    test_int("Test hll empty count\n", 0, bitset_hll_count(h));
+    b5 = bitset_new();
+    for (unsigned i = 0; i < 100000; i++) {
+        bitset_set(b5, i * 3);
+    }
+    bitset_hll_add(h, b5);
+    bitset_hll_add(h, b5);
+    unsigned estimate = bitset_hll_count(h);
+    test_bool("Test hll count\n", true, estimate > 97000 && estimate < 103000);
+    bitset_hll_free(h);
+    h = bitset_hll_new(0);
+    test_int("Test hll max precision size\n", 262144, h->size);
+    bitset_hll_free(h);
+    h = bitset_hll_new(-1);
+    test_int("Test hll max precision size 2\n", 262144, h->size);
+    bitset_hll_free(h);
+    bitset_free(b5);
 }
 
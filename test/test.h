@@ -12,6 +12,7 @@ void test_suite_set();
 void test_suite_stress();
 void test_suite_count();
 void test_suite_operation();
+void test_suite_predicate();
 void test_suite_min();
 void test_suite_max();
 void test_suite_vector();